@@ -24,6 +24,8 @@
  */
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdio.h>
@@ -32,6 +34,16 @@
 #include <errno.h>
 #include <dirent.h>
 #include <time.h>
+#include <fnmatch.h>
+#include <regex.h>
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
 
 #include "sha256.h"
 #include "sha1.h"
@@ -48,6 +60,9 @@
 #include <fstream>
 #include <list>
 #include <map>
+#include <vector>
+#include <set>
+#include <algorithm>
 
 //#define EMIT_RESERVE_VOLUME_DESCRIPTOR
 
@@ -59,10 +74,16 @@ signed long long lseek64(int fd,signed long long ofs,int whence);
 using namespace std;
 
 /* variables */
+static UDF_Uint16	udf_revision = 0x0102;	/* -udf-rev: 0x0102 (NSR02), or 0x0250 (NSR03, metadata partition, Extended File Entries) */
+#define DESCRIPTOR_VERSION	(udf_revision >= 0x0250 ? 3 : 2)	/* of every descriptor tag: 3 with NSR03 */
 static UDF_timestamp	volume_recordtime;
 static UDF_Uint64	iso_size_limit = 0;	/* we can error out and tell the shell script we can't fit it below this limit */
 						/* this is preferable to mkisofs silently dropping files from the iso if they
 						 * fail a certain criteria, like being >= 4GB, grrrr >:{ */
+static int		print_size = 0;		/* -print-size: plan the layout, print the size of the ISO and stop */
+static UDF_Uint64	span_capacity = 0;	/* -span: spread the contents over as many volumes of this size as it takes */
+static UDF_Uint32	volume_sequence = 1;	/* this volume's number in the volume set */
+static UDF_Uint32	volume_sequence_max = 1;/* and how many volumes there are */
 static string		content_root;		/* the directory who's contents we package into the ISO */
 static string		iso_file;
 static string		volume_label = "";
@@ -77,10 +98,33 @@ static string		gap_file;		/* a "gap file" contains a list of unused areas of the
 static int		auto_sparse_detect=0;	/* 1=detect holes (runs of zeros) in files and mark them as "not allocated not recorded" extents.
 						   this makes them sparse files. the runs of zeros can then be reused for other purposes. */
 static int		iso_overwrite=0;	/* 1=if ISO exists, overwrite it. else, return error */
+static int		dedupe_files=0;		/* 1=files with the same contents share one data extent */
+static int		cluster_metadata=0;	/* 1=all directories and File Entries first (breadth first), then the file data */
+static UDF_Uint64	align_sectors=0;	/* -align: file data of at least this many sectors starts on a multiple of it (ECC block) */
+static int		align_dirs=0;		/* -align-dirs: so do directories */
+static int		bdmv_mode=0;		/* -bdmv: Blu-ray layout of the BDMV directory, see bdmv_stream() */
+static UDF_Uint64	layer_break=0;		/* -layer-break: the first sector of the second layer, nothing is allocated across it */
+static string		access_trace;		/* -access-trace: the files in the order they are read, see access_traced() */
+static int		trace_cav=0;		/* -cav: the traced files go to the outer zone (the end of the data) */
+static string		tar_source;		/* take the contents from a tar/pax stream instead of a directory ("-" = stdin) */
+static int		iso_fd = 1;		/* STDOUT by default */
+static int		iso_holes = 0;		/* the ISO file started out empty, sectors of zeros can be left as holes */
+static int		source_order = 0;	/* -source-order: copy the files in the order they lie on the source, see source_order_write() */
+static time_t		build_time;		/* every timestamp mkudfiso makes itself. kept in the journal so a resumed build lays out the same */
+static string		patch_target;		/* -patch: rewrite the volume label, timestamps, report of this existing ISO */
+static time_t		patch_time = 0;		/* -timestamp: new recording time for -patch */
+static int		append_session = 0;	/* -append: add a session to the existing ISO iso_file */
+static int		resume_build = 0;	/* continue an interrupted build, see the build journal */
+static string		previous_image;		/* incremental rebuild: the ISO of the previous build, and its report */
+static string		previous_report;
 
 UDF_Uint32 PartitionStart = 0;
 UDF_Uint32 PartitionTagSector = 0;
 
+/* -udf-rev 2.50: the metadata partition, sectors metadata_start...metadata_end-1 of the physical partition.
+ * it's filled in order up to metadata_next, the rest of it stays reserved. metadata_end == 0 means there's none */
+static UDF_Uint64 metadata_start = 0,metadata_next = 0,metadata_end = 0;
+
 UDF_Uint64 metric_atoi(char *s) {
 	char *t = NULL;
 	UDF_Uint64 v = strtoull(s,&t,0);
@@ -136,13 +180,130 @@ static unsigned short osta_crc_table[256] = {
 	0xEF1F, 0xFF3E, 0xCF5D, 0xDF7C, 0xAF9B, 0xBFBA, 0x8FD9, 0x9FF8,
 	0x6E17, 0x7E36, 0x4E55, 0x5E74, 0x2E93, 0x3EB2, 0x0ED1, 0x1EF0
 };
-unsigned short osta_cksum(unsigned char *s,int n)
+static unsigned short osta_cksum_update(unsigned short crc,const unsigned char *s,int n)
 {
-	register unsigned short crc=0;
 	while (n-- > 0) crc = osta_crc_table[(crc>>8 ^ *s++) & 0xff] ^ (crc<<8);
 	return crc;
 }
 
+static unsigned short osta_cksum_table(const unsigned char *s,int n)
+{
+	return osta_cksum_update(0,s,n);
+}
+
+/* slice-by-8: osta_crc_slice[k][b] is the CRC of byte b followed by k zero bytes, so eight bytes
+ * take eight lookups that don't wait for each other. made from osta_crc_table */
+static unsigned short osta_crc_slice[8][256];
+
+static void osta_crc_slice_init()
+{
+	int k,b;
+
+	for (b=0;b < 256;b++) osta_crc_slice[0][b] = osta_crc_table[b];
+	for (k=1;k < 8;k++)
+		for (b=0;b < 256;b++) {
+			unsigned short v = osta_crc_slice[k-1][b];
+			osta_crc_slice[k][b] = (unsigned short)(v << 8) ^ osta_crc_table[v >> 8];
+		}
+}
+
+static unsigned short osta_cksum_slice8_update(unsigned short crc,const unsigned char *s,int n)
+{
+	while (n >= 8) {
+		unsigned short c = crc ^ (((unsigned short)s[0] << 8) | s[1]);
+		crc =	osta_crc_slice[7][c >> 8] ^ osta_crc_slice[6][c & 0xff] ^
+			osta_crc_slice[5][s[2]] ^ osta_crc_slice[4][s[3]] ^
+			osta_crc_slice[3][s[4]] ^ osta_crc_slice[2][s[5]] ^
+			osta_crc_slice[1][s[6]] ^ osta_crc_slice[0][s[7]];
+		s += 8;
+		n -= 8;
+	}
+	return osta_cksum_update(crc,s,n);
+}
+
+static unsigned short osta_cksum_slice8(const unsigned char *s,int n)
+{
+	return osta_cksum_slice8_update(0,s,n);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+/* carry-less multiplication: the data is folded 16 bytes at a time into a 128 bit remainder R (as a
+ * polynomial, congruent to what has been read so far modulo the CRC polynomial). with R = H*x^64 + L,
+ * reading block B makes it H*(x^192 mod P) + L*(x^128 mod P) + B. R is then 16 bytes whose CRC is the
+ * CRC so far, and the table does those and the last few bytes */
+static unsigned long long osta_fold_k1 = 0,osta_fold_k2 = 0;	/* x^192 and x^128 mod P */
+
+static unsigned long long osta_xpow_mod(int n)
+{
+	unsigned int r = 1;
+	while (n-- > 0) {
+		r <<= 1;
+		if (r & 0x10000) r ^= 0x11021;
+	}
+	return r;
+}
+
+__attribute__((target("pclmul,ssse3")))
+static unsigned short osta_cksum_clmul(const unsigned char *s,int n)
+{
+	if (n < 32) return osta_cksum_slice8(s,n);
+
+	const __m128i swap = _mm_set_epi8(0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15);
+	const __m128i k = _mm_set_epi64x(osta_fold_k1,osta_fold_k2);
+	__m128i r = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)s),swap);
+	unsigned char tail[16];
+
+	s += 16;
+	n -= 16;
+	while (n >= 16) {
+		__m128i b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)s),swap);
+		r = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(r,k,0x11),_mm_clmulepi64_si128(r,k,0x00)),b);
+		s += 16;
+		n -= 16;
+	}
+
+	_mm_storeu_si128((__m128i*)tail,_mm_shuffle_epi8(r,swap));
+	return osta_cksum_slice8_update(osta_cksum_slice8_update(0,tail,16),s,n);
+}
+#endif
+
+/* the fastest the CPU has, picked once (see osta_cksum_init()) */
+static unsigned short (*osta_cksum_impl)(const unsigned char *s,int n) = osta_cksum_table;
+
+unsigned short osta_cksum(unsigned char *s,int n)
+{
+	return osta_cksum_impl(s,n);
+}
+
+/* pick the CRC routine and check it against the table, one byte at a time, on every length up to a
+ * sector and a half. 0 if it doesn't agree */
+static int osta_cksum_init()
+{
+	unsigned char buf[3072];
+	unsigned int x = 12345;
+	int n;
+
+	osta_crc_slice_init();
+	osta_cksum_impl = osta_cksum_slice8;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3")) {
+		osta_fold_k1 = osta_xpow_mod(192);
+		osta_fold_k2 = osta_xpow_mod(128);
+		osta_cksum_impl = osta_cksum_clmul;
+	}
+#endif
+
+	for (n=0;n < (int)sizeof(buf);n++) {
+		x = x * 1103515245 + 12345;
+		buf[n] = x >> 16;
+	}
+	for (n=0;n <= (int)sizeof(buf);n++)
+		if (osta_cksum_impl(buf,n) != osta_cksum_table(buf,n) || osta_cksum_slice8(buf,n) != osta_cksum_table(buf,n))
+			return 0;
+	return 1;
+}
+
 static void UDF_timestamp_set(UDF_timestamp &ut,time_t tt)
 {
 	struct tm *t = gmtime(&tt);
@@ -158,6 +319,14 @@ static void UDF_timestamp_set(UDF_timestamp &ut,time_t tt)
 	ut.Microseconds = 0;
 }
 
+/* "YYYY-MM-DD HH:MM:SS", as written in the report */
+static string UDF_timestamp_str(const UDF_timestamp &ut)
+{
+	char tmp[64];
+	sprintf(tmp,"%04d-%02u-%02u %02u:%02u:%02u",ut.Year,ut.Month,ut.Day,ut.Hour,ut.Minute,ut.Second);
+	return string(tmp);
+}
+
 UDF_Uint32 UnixToUDF(unsigned long p) {
 	UDF_Uint32 r = (p & 7) | (((p >> 3) & 7) << 5) | (((p >> 6) & 7) << 10);
 	return r;
@@ -175,6 +344,15 @@ class FileEntry {
 			UDF_timestamp_set(file_ctime,0);
 			UDF_timestamp_set(file_mtime,0);
 			hash_length = 0;
+			src_fd = -1;
+			src_offset = 0;
+			fixed_start = 0;
+			existing_fe = 0;
+			volume = 0;
+			same_as = 0;
+			link_id = 0;
+			hole_sectors = 0;
+			trace_order = trace_count = 0;
 		}
 	public:
 		UDF_Uint64	id,parent;		/* used to build parent/child relationship */
@@ -188,6 +366,17 @@ class FileEntry {
 		string		name;
 		string		abspath;
 		string		path;
+		int		src_fd;			/* if >= 0, the contents are read from here at src_offset instead of abspath */
+		UDF_Uint64	src_offset;
+		UDF_Uint64	fixed_start;		/* if nonzero, the data is already placed at this sector */
+		UDF_Uint32	existing_fe;		/* if nonzero, the File Entry (partition block) of the file in the image being appended to */
+		UDF_Uint32	volume;			/* -span: the volume a file goes on (directories with no files below them: 1) */
+		UDF_Uint64	same_as;		/* -dedupe: the first file with the same contents, whose data this one shares */
+		UDF_Uint64	link_id;		/* hard links: the first link's id (its own, for the first), 0 if not linked */
+		map<UDF_Uint64,UDF_Uint64> holes;	/* -sparse: runs of zero sectors that aren't stored, byte offset -> length */
+		UDF_Uint64	hole_sectors;
+		UDF_Uint64	trace_order;		/* -access-trace: where the file first comes in the trace (1 = first), 0 if not in it */
+		UDF_Uint64	trace_count;		/* -access-trace: how often it is read */
 	public:
 		sha256_context	sha256_ctx;
 		UDF_Uint8	sha256[32];
@@ -204,6 +393,7 @@ typedef struct SingleSectorGap {
 
 map<UDF_Uint64,FileEntry>	file_list;
 UDF_Uint64			file_list_total = 0;
+UDF_Uint64			file_list_sectors = 0;	/* File Entries, directories and data of the entries so far */
 map<UDF_Uint64,UDF_Uint64>	parent_dir_to_first_file;
 map<UDF_Uint64,SingleSectorGap>	single_sector_gaps;
 
@@ -214,6 +404,8 @@ class OutputExtent {
 			content = NULL;
 			content_length = 0;
 			start = end = 0;
+			prewritten = 0;
+			mirror_of = 0;
 		}
 		~OutputExtent() {
 			clear();
@@ -245,39 +437,117 @@ class OutputExtent {
 		UDF_Uint8*	content;		// actual contents
 		int		content_length;
 		UDF_Uint64	start,end;		// starting/ending sectors (start <= x < end)
+		char		prewritten;		// the sectors are already in the ISO file, don't write them again
+		UDF_Uint64	mirror_of;		// non-zero: a copy of the sectors from there on (the metadata mirror)
 };
 
 map<UDF_Uint64,OutputExtent>	output_extents;
 static UDF_Uint64		output_extents_solid = 16;
 
-OutputExtent *NewOutputExtent(UDF_Uint64 start=0,UDF_Uint64 size=1) {
-	if (start == 0) {
-		map<UDF_Uint64,OutputExtent>::iterator i = output_extents.lower_bound(output_extents_solid);
-		if (i == output_extents.end()) start = 16;
-		else {
-			start = 0;
-			do {
-				UDF_Uint64 first = i->second.start;
-				UDF_Uint64 last = i->second.end;
-				i++;
+static inline UDF_Uint64 extent_end(const OutputExtent &e) { return e.end; }
+static inline UDF_Uint64 extent_end(const UDF_Uint64 &end) { return end; }
+
+/* first fit: the first gap after "solid" where size sectors fit, starting on a multiple of align,
+ * or the end of the last extent. the extents are kept by their starting sector. shared by the
+ * layout and the size planner. with -layer-break nothing is placed across the break: what doesn't
+ * fit in front of it goes after it, and the room left in front of it goes to what comes later */
+template <class T> static UDF_Uint64 first_fit(map<UDF_Uint64,T> &extents,UDF_Uint64 &solid,UDF_Uint64 size,UDF_Uint64 align=1) {
+	typename map<UDF_Uint64,T>::iterator i = extents.lower_bound(solid);
+	if (i == extents.end()) return 16;
+
+	UDF_Uint64 start = 0;
+	do {
+		UDF_Uint64 last = extent_end(i->second);
+		UDF_Uint64 aligned = (last + align - 1) / align * align;
+		if (layer_break && aligned < layer_break && (aligned + size) > layer_break)
+			aligned = (layer_break + align - 1) / align * align;
+		i++;
+
+		UDF_Uint64 next = 0;
+		if (i != extents.end()) next = i->first;
+
+		if (next && last >= next) {
+			solid = next;
+		}
+		else if (next == 0) {
+			start = aligned;
+			break;
+		}
+		else if ((aligned+size) <= next) {
+			start = aligned;
+			break;
+		}
+	} while (i != extents.end());
 
-				UDF_Uint64 next = 0;
-				if (i != output_extents.end()) next = i->second.start;
+	return start;
+}
 
-				if (next && last >= next) {
-					output_extents_solid = next;
-				}
-				else if (next == 0) {
-					start = last;
-					break;
-				}
-				else if ((last+size) <= next) {
-					start = last;
-					break;
-				}
-			} while (i != output_extents.end());
-		}
+/* -bdmv: is the entry in BDMV/<dir> (dir NULL: in BDMV itself), BDMV being in the root? */
+static int bdmv_in(const FileEntry *f,const char *dir) {
+	map<UDF_Uint64,FileEntry>::iterator p = file_list.find(f->parent);
+	if (dir) {
+		if (p == file_list.end() || strcasecmp(p->second.name.c_str(),dir)) return 0;
+		p = file_list.find(p->second.parent);
+	}
+	return p != file_list.end() && p->second.parent == 0 && !strcasecmp(p->second.name.c_str(),"BDMV");
+}
 
+static int name_has_extension(const FileEntry *f,const char *ext) {
+	size_t l = strlen(ext);
+	return f->name.length() > l && !strcasecmp(f->name.c_str() + f->name.length() - l,ext);
+}
+
+/* -bdmv: a clip AV stream, BDMV/STREAM/<clip>.m2ts. it's kept in one piece (not -sparse) and
+ * starts on an aligned unit (6144 bytes, 3 sectors) that is also an ECC block boundary */
+static int bdmv_stream(const FileEntry *f) {
+	return bdmv_mode && !(f->characteristics & 2) && name_has_extension(f,".m2ts") && bdmv_in(f,"STREAM");
+}
+
+/* -bdmv: what a player reads before it plays anything: index.bdmv, MovieObject.bdmv and the
+ * playlists and clip information. their data goes together, right after the root directory.
+ * hard links are left alone, any of them could end up with the File Entry */
+static int bdmv_navigation(const FileEntry *f) {
+	if (!bdmv_mode || (f->characteristics & 2) || f->link_id || f->existing_fe) return 0;
+	if (bdmv_in(f,NULL))
+		return !strcasecmp(f->name.c_str(),"index.bdmv") || !strcasecmp(f->name.c_str(),"MovieObject.bdmv");
+	return (name_has_extension(f,".mpls") && bdmv_in(f,"PLAYLIST")) ||
+		(name_has_extension(f,".clpi") && bdmv_in(f,"CLIPINF"));
+}
+
+#define BDMV_ALIGNED_UNIT	3	/* sectors */
+
+/* -bdmv: say so if the tree doesn't look like a Blu-ray disc */
+static void bdmv_check() {
+	map<UDF_Uint64,FileEntry>::iterator i;
+	int found = 0;
+
+	for (i=file_list.begin();i != file_list.end();i++) {
+		FileEntry *f = &i->second;
+		if (f->parent == 0 && (f->characteristics & 2) && !strcasecmp(f->name.c_str(),"BDMV")) found = 1;
+		if (bdmv_stream(f) && (f->file_size % (BDMV_ALIGNED_UNIT * 2048)) != 0)
+			cerr << "WARNING: " << f->abspath << " is not made of whole 6144 byte aligned units" << endl;
+	}
+	if (!found)
+		cerr << "WARNING: -bdmv: there is no BDMV directory in the root" << endl;
+}
+
+/* -align: how the data of a file (f NULL: with -align-dirs, a directory) of this many sectors is
+ * aligned. the ECC block it starts in is then read for its own sake, and the padding in front of
+ * it is left to first fit: the File Entries, directories and small files laid out later fill it */
+static inline UDF_Uint64 data_alignment(UDF_Uint64 sectors,const FileEntry *f) {
+	if (f && bdmv_stream(f)) {
+		/* the least common multiple of the aligned unit and the ECC block (a BD cluster by default) */
+		UDF_Uint64 ecc = align_sectors ? align_sectors : 32;
+		return (ecc % BDMV_ALIGNED_UNIT) ? (ecc * BDMV_ALIGNED_UNIT) : ecc;
+	}
+	if (!align_sectors) return 1;
+	if (f ? (sectors >= align_sectors) : align_dirs) return align_sectors;
+	return 1;
+}
+
+OutputExtent *NewOutputExtent(UDF_Uint64 start=0,UDF_Uint64 size=1,UDF_Uint64 align=1) {
+	if (start == 0) {
+		start = first_fit(output_extents,output_extents_solid,size,align);
 		assert(start >= 16);
 	}
 
@@ -286,6 +556,63 @@ OutputExtent *NewOutputExtent(UDF_Uint64 start=0,UDF_Uint64 size=1) {
 	return e;
 }
 
+/* -udf-rev 2.50: the metadata partition is allocated and aligned in units of METADATA_UNIT sectors
+ * (32, an ECC block of BD media). metadata_fit() finds the first aligned run of size free sectors
+ * from 'from' on that stays clear of the anchor at 256. shared by the layout and the size planner */
+#define METADATA_UNIT		32
+
+static inline UDF_Uint64 metadata_align(UDF_Uint64 s) {
+	return (s + METADATA_UNIT - 1) / METADATA_UNIT * METADATA_UNIT;
+}
+
+template <class T> static UDF_Uint64 metadata_fit(map<UDF_Uint64,T> &extents,UDF_Uint64 from,UDF_Uint64 size) {
+	UDF_Uint64 start = metadata_align(from);
+
+	while (1) {
+		if (start <= 256 && (start + size) > 256) {
+			start = metadata_align(257);
+			continue;
+		}
+
+		typename map<UDF_Uint64,T>::iterator i = extents.lower_bound(start);
+		if (i != extents.end() && i->first < (start + size)) {
+			start = metadata_align(extent_end(i->second));
+			continue;
+		}
+		if (i != extents.begin() && extent_end((--i)->second) > start) {
+			start = metadata_align(extent_end(i->second));
+			continue;
+		}
+
+		return start;
+	}
+}
+
+/* File Entries, directories and AEDs. with a metadata partition they take its sectors in order,
+ * and a placeholder keeps what's left of it from being allocated for anything else */
+static OutputExtent *NewMetadataExtent(UDF_Uint64 start=0,UDF_Uint64 size=1,UDF_Uint64 align=1) {
+	if (!metadata_end)
+		return NewOutputExtent(start,size,align);
+
+	if ((start != 0 && start != metadata_next) || (metadata_next + size) > metadata_end)
+		cerr << "BUG: The metadata partition was planned too small, or out of order (sector " << metadata_next << ")" << endl;
+
+	OutputExtent *e = NewOutputExtent(metadata_next,size);
+	metadata_next += size;
+	if (metadata_next < metadata_end)
+		NewOutputExtent(metadata_next,metadata_end - metadata_next);
+
+	return e;
+}
+
+/* the logical block number of a File Entry, directory or AED, and the partition it's in:
+ * the metadata partition (partition reference 1) when there is one */
+static inline UDF_Uint32 metadata_lbn(UDF_Uint64 sector) {
+	return sector - (metadata_end ? metadata_start : PartitionStart);
+}
+
+#define METADATA_PARTITION	(metadata_end ? 1 : 0)
+
 string humanize(UDF_Uint64 s) {
 	char *suffix = "b";
 	int fraction = 0; // 0-999 only (3 digits)
@@ -361,7 +688,256 @@ int extra_large_chdir(const char *path) {
 	return 0;
 }
 
-static int scan_contents(const char *basepath,UDF_Uint64 base_id=0) {
+/* --exclude/--include rules. The rules are compiled once after argument parsing and checked
+ * in scan_contents() BEFORE the entry is stat'd, so an excluded subtree is never visited.
+ * The first rule (in command line order) that matches decides, entries that match no rule
+ * are included. Glob patterns without a '/' match the name at any depth, patterns with a
+ * '/' match the path relative to the content root. A trailing '/' limits the rule to
+ * directories. Regular expressions (POSIX extended) always match the relative path. */
+class ScanRule {
+	public:
+		ScanRule() {
+			include = dir_only = full_path = is_regex = 0;
+		}
+	public:
+		int		include;		/* 1=include rule, 0=exclude rule */
+		int		dir_only;		/* pattern ended in '/', applies to directories only */
+		int		full_path;		/* match against the relative path instead of the name */
+		int		is_regex;
+		string		pattern;
+		regex_t		re;
+};
+
+static vector<ScanRule>		scan_rules;
+static map<string,int>		scan_rules_literal;	/* exact names -> first rule index */
+static map<string,int>		scan_rules_suffix;	/* "*.ext" patterns by ".ext" -> first rule index */
+static vector<int>		scan_rules_generic;	/* everything else, in rule order */
+static int			scan_rules_dir_only = 0;
+
+static void scan_rule_add(const char *pattern,int include,int is_regex) {
+	ScanRule r;
+	r.include = include;
+	r.is_regex = is_regex;
+	r.pattern = pattern;
+	scan_rules.push_back(r);
+}
+
+/* sort the rules into buckets so that the common cases (plain names like ".git" and
+ * extensions like "*.tmp") cost one map lookup instead of a pattern match per rule */
+static int scan_rules_compile() {
+	unsigned int i;
+
+	for (i=0;i < scan_rules.size();i++) {
+		ScanRule *r = &scan_rules[i];
+
+		if (r->is_regex) {
+			int err = regcomp(&r->re,r->pattern.c_str(),REG_EXTENDED | REG_NOSUB);
+			if (err != 0) {
+				char msg[256];
+				regerror(err,&r->re,msg,sizeof(msg));
+				fprintf(stderr,"Bad regular expression '%s': %s\n",r->pattern.c_str(),msg);
+				return 0;
+			}
+			r->full_path = 1;
+			scan_rules_generic.push_back(i);
+			continue;
+		}
+
+		string p = r->pattern;
+		if (p.length() > 1 && p[p.length()-1] == '/') {
+			p = p.substr(0,p.length()-1);
+			r->dir_only = 1;
+			scan_rules_dir_only = 1;
+		}
+		while (p.length() > 1 && p[0] == '/') {
+			/* a leading '/' anchors the pattern to the content root */
+			p = p.substr(1);
+			r->full_path = 1;
+		}
+		if (p.find('/') != string::npos)
+			r->full_path = 1;
+		r->pattern = p;
+
+		if (r->full_path || r->dir_only) {
+			scan_rules_generic.push_back(i);
+		}
+		else if (p.find_first_of("*?[\\") == string::npos) {
+			if (scan_rules_literal.find(p) == scan_rules_literal.end())
+				scan_rules_literal[p] = i;
+		}
+		else if (p.length() > 2 && p[0] == '*' && p[1] == '.' && p.find_first_of("*?[\\",1) == string::npos) {
+			string suffix = p.substr(1);
+			if (scan_rules_suffix.find(suffix) == scan_rules_suffix.end())
+				scan_rules_suffix[suffix] = i;
+		}
+		else {
+			scan_rules_generic.push_back(i);
+		}
+	}
+
+	return 1;
+}
+
+/* returns 1 if the entry is to be left out. is_dir is 1 for directories, 0 for anything else */
+static int scan_rules_exclude(const char *name,const string &relpath,int is_dir) {
+	int best = (int)scan_rules.size();
+	map<string,int>::iterator mi;
+
+	if (best == 0)
+		return 0;
+
+	if ((mi = scan_rules_literal.find(name)) != scan_rules_literal.end())
+		best = mi->second;
+
+	if (!scan_rules_suffix.empty()) {
+		const char *dot = strchr(name,'.');
+		while (dot) {
+			if ((mi = scan_rules_suffix.find(dot)) != scan_rules_suffix.end() && mi->second < best)
+				best = mi->second;
+			dot = strchr(dot+1,'.');
+		}
+	}
+
+	/* generic rules are kept in rule order, there is no point checking past the best match so far */
+	unsigned int i;
+	for (i=0;i < scan_rules_generic.size() && scan_rules_generic[i] < best;i++) {
+		ScanRule *r = &scan_rules[scan_rules_generic[i]];
+		if (r->dir_only && !is_dir)
+			continue;
+
+		int match;
+		if (r->is_regex)
+			match = (regexec(&r->re,relpath.c_str(),0,NULL,0) == 0);
+		else if (r->full_path)
+			match = (fnmatch(r->pattern.c_str(),relpath.c_str(),FNM_PATHNAME) == 0);
+		else
+			match = (fnmatch(r->pattern.c_str(),name,0) == 0);
+
+		if (match) {
+			best = scan_rules_generic[i];
+			break;
+		}
+	}
+
+	if (best >= (int)scan_rules.size())
+		return 0;
+
+	return !scan_rules[best].include;
+}
+
+/* size planning. every entry takes a File Entry sector, a File Identifier in its parent directory
+ * and, unless it's small enough to be embedded in the File Entry, the sectors of its data. before
+ * the root directory come the volume recognition sequence, the bragging sector, the Volume
+ * Descriptor Sequence, the Logical Volume Integrity Descriptor, the File Set Descriptor and its
+ * terminator and the root File Entry, and the anchor at 256 comes on top of that */
+#ifdef EMIT_RESERVE_VOLUME_DESCRIPTOR
+#define PLAN_FIXED_SECTORS	37
+#else
+#define PLAN_FIXED_SECTORS	31
+#endif
+
+static inline int UDF_file_identifier_size(const FileEntry *oex) {
+	int sz =
+		16 + 2 + 1 + 1 + 16 + 2 +
+		0 + /* Length of Implementation Use */
+		oex->name.length() + 1;		/* File Identifier (as a d-string) */
+	return (sz + 3) & (~3);			/* padding (up to next DWORD) */
+}
+
+/* -udf-rev 2.50 records Extended File Entries, 40 bytes longer, and describes the data with
+ * long_ads: from the metadata partition a short_ad couldn't point into the physical partition.
+ * FE_EMBED_MAX is how much data fits in the File Entry itself */
+#define FE_HEADER_SIZE		(udf_revision >= 0x0250 ? 216 : 176)
+#define FE_AD_SIZE		(udf_revision >= 0x0250 ? 16 : 8)
+#define FE_EMBED_MAX		(2048-FE_HEADER_SIZE)
+
+/* the sectors of a directory with this many bytes of FIDs. a subdirectory that small keeps them in
+ * its File Entry as a small file keeps its data, the root directory always has a sector of its own */
+static inline UDF_Uint64 directory_sectors(UDF_Uint64 bytes,int root) {
+	if (!root && bytes < FE_EMBED_MAX) return 0;
+	return (bytes + 2047ULL) >> 11ULL;
+}
+
+static inline UDF_Uint64 file_data_sectors(const FileEntry *oex) {
+	if ((oex->characteristics & 2) || oex->file_size < FE_EMBED_MAX) return 0;
+	return ((oex->file_size + 2047ULL) >> 11ULL) - oex->hole_sectors;
+}
+
+/* A file's data is described by short_ads (long_ads) of at most UDF_MAX_EXTENT bytes (the largest
+ * multiple of the sector size an extent length can hold), one per run of data or (-sparse) zeros.
+ * The File Entry holds FE_MAX_ADS of them; more than that and the last one points at an Allocation
+ * Extent Descriptor, which holds AED_MAX_ADS and can point at another one, and so on */
+#define UDF_MAX_EXTENT		0x3FFFF800UL
+#define FE_MAX_ADS		((2048-FE_HEADER_SIZE)/FE_AD_SIZE)
+#define AED_MAX_ADS		((2048-24)/FE_AD_SIZE)
+
+static UDF_Uint64 file_extent_count(const FileEntry *oex) {
+	map<UDF_Uint64,UDF_Uint64>::const_iterator hi;
+	UDF_Uint64 ofs = 0,n = 0;
+
+	if (file_data_sectors(oex) == 0) return 0;
+	for (hi=oex->holes.begin();hi != oex->holes.end();hi++) {
+		if (hi->first > ofs) n += (hi->first - ofs + UDF_MAX_EXTENT - 1) / UDF_MAX_EXTENT;
+		n += (hi->second + UDF_MAX_EXTENT - 1) / UDF_MAX_EXTENT;
+		ofs = hi->first + hi->second;
+	}
+	if (oex->file_size > ofs) n += (oex->file_size - ofs + UDF_MAX_EXTENT - 1) / UDF_MAX_EXTENT;
+	return n;
+}
+
+/* the Allocation Extent Descriptors (a sector each) a file needs */
+static UDF_Uint64 file_aed_sectors(const FileEntry *oex) {
+	UDF_Uint64 n = file_extent_count(oex);
+	if (n <= FE_MAX_ADS) return 0;
+
+	/* the File Entry keeps all but one, every AED but the last all but one too */
+	n -= FE_MAX_ADS - 1;
+	if (n <= AED_MAX_ADS) return 1;
+	return 1 + (n - 2) / (AED_MAX_ADS - 1);
+}
+
+/* -udf-rev 2.50: the sectors the metadata partition needs. the File Set Descriptor, its terminator
+ * and the root File Entry, every directory, and every File Entry and AED the layout will make */
+static UDF_Uint64 metadata_sectors() {
+	map<UDF_Uint64,FileEntry>::iterator i;
+	map<UDF_Uint64,UDF_Uint64> dir_bytes;
+	set<UDF_Uint64> linked;
+	UDF_Uint64 n = 3;
+
+	dir_bytes[0] = 40;	/* . and .. */
+	for (i=file_list.begin();i != file_list.end();i++) {
+		FileEntry *oex = &i->second;
+		dir_bytes[oex->parent] += UDF_file_identifier_size(oex);
+		if (oex->characteristics & 2) dir_bytes[oex->id] += 40;
+		if (oex->existing_fe) continue;
+		if (oex->link_id && !linked.insert(oex->link_id).second) continue;
+		n += 1 + file_aed_sectors(oex);
+	}
+
+	map<UDF_Uint64,UDF_Uint64>::iterator di;
+	for (di=dir_bytes.begin();di != dir_bytes.end();di++)
+		n += directory_sectors(di->second,di->first == 0);
+
+	return n;
+}
+
+/* the entries scanned so far already need more than -limit allows. this can only underestimate
+ * (gaps the layout leaves are not known yet), so it's safe to give up as soon as it says so */
+static int plan_over_limit() {
+	UDF_Uint64 s = PLAN_FIXED_SECTORS + file_list_sectors;
+	if (s >= 256) s++;
+	if (!iso_size_limit || (s << 11ULL) <= iso_size_limit)
+		return 0;
+
+	cerr << "ERROR: The ISO would exceed the limit you specified (" << humanize(s << 11ULL) <<
+		" at least, and the scan isn't finished)" << endl;
+	return 1;
+}
+
+/* hard links: the first link scanned of each (device, inode), the others share its File Entry */
+static map< pair<dev_t,ino_t>,UDF_Uint64 >	scan_inodes;
+
+static int scan_contents(const char *basepath,UDF_Uint64 base_id=0,const string &relbase=string()) {
 	if (extra_large_chdir(basepath) < 0) {
 		fprintf(stderr,"Cannot enter %s\n",basepath);
 		return 0;
@@ -373,17 +949,37 @@ static int scan_contents(const char *basepath,UDF_Uint64 base_id=0) {
 		return 0;
 	}
 
-	int idcount=0;
+	int idcount=0,dir_bytes=40;
 	struct dirent *de;
 	list<UDF_Uint64> new_ids;
 	while ((de = readdir(dir)) != NULL) {
 		if (!strcmp(de->d_name,".") || !strcmp(de->d_name,".."))
 			continue;
 
-		string abs_path = string(basepath) + string("/") + string(de->d_name);
+		string rel_path = relbase.length() > 0 ? (relbase + string("/") + string(de->d_name)) : string(de->d_name);
 
+		/* check the rules first, excluded entries (and everything below them) are never stat'd */
+		int stat_done = 0;
 		struct stat64 st;
-		if (lstat64(de->d_name,&st) < 0) {
+		if (!scan_rules.empty()) {
+			int is_dir = (de->d_type == DT_DIR) ? 1 : 0;
+			if (de->d_type == DT_UNKNOWN && scan_rules_dir_only) {
+				/* the filesystem doesn't tell us the type, we have to ask */
+				if (lstat64(de->d_name,&st) < 0) {
+					fprintf(stderr,"Cannot stat %s/%s, ignoring\n",basepath,de->d_name);
+					continue;
+				}
+				is_dir = S_ISDIR(st.st_mode) ? 1 : 0;
+				stat_done = 1;
+			}
+
+			if (scan_rules_exclude(de->d_name,rel_path,is_dir))
+				continue;
+		}
+
+		string abs_path = string(basepath) + string("/") + string(de->d_name);
+
+		if (!stat_done && lstat64(de->d_name,&st) < 0) {
 			fprintf(stderr,"Cannot stat %s/%s, ignoring\n",basepath,de->d_name);
 			continue;
 		}
@@ -416,77 +1012,2489 @@ static int scan_contents(const char *basepath,UDF_Uint64 base_id=0) {
 		UDF_timestamp_set(fl->file_ctime,st.st_ctime);
 		UDF_timestamp_set(fl->file_mtime,st.st_mtime);
 
+		if (S_ISREG(st.st_mode) && st.st_nlink > 1) {
+			map< pair<dev_t,ino_t>,UDF_Uint64 >::iterator li =
+				scan_inodes.insert(pair< pair<dev_t,ino_t>,UDF_Uint64 >(pair<dev_t,ino_t>(st.st_dev,st.st_ino),id)).first;
+			fl->link_id = li->second;
+		}
+
 		if (S_ISDIR(st.st_mode))
 			new_ids.push_back(id);
-		else
+		else if (fl->link_id == 0 || fl->link_id == id)
 			file_list_total += fl->file_size;
 
 		if (idcount == 0) parent_dir_to_first_file[base_id] = id;
 		idcount++;
+
+		/* duplicates (-dedupe) and runs of zeros (-sparse) aren't known yet, so the data
+		 * can't count. another link to a file already scanned is only a FID */
+		if (fl->link_id == 0 || fl->link_id == id)
+			file_list_sectors += 1 + ((dedupe_files || auto_sparse_detect) ? 0 : file_data_sectors(fl));
+		dir_bytes += UDF_file_identifier_size(fl);
+		if (plan_over_limit()) {
+			closedir(dir);
+			return -1;
+		}
 	}
 	closedir(dir);
 
+	file_list_sectors += directory_sectors(dir_bytes,base_id == 0);
+	if (plan_over_limit())
+		return -1;
+
 	{
 		list<UDF_Uint64>::iterator i;
 		for (i=new_ids.begin();i != new_ids.end();i++) {
 			UDF_Uint64 parent_id = *i;
 			FileEntry *parent = &file_list[parent_id];
-			scan_contents(parent->abspath.c_str(),parent_id);
+			if (scan_contents(parent->abspath.c_str(),parent_id,
+				relbase.length() > 0 ? (relbase + string("/") + parent->name) : parent->name) < 0)
+				return -1;
 		}
 	}
 
 	return 1;
 }
 
-static int parse_args(int argc,char **argv) {
-	int i,nonsw=0;
-	char forget=0;
+/* A source tree kept in memory, for contents that don't come from scanning a directory
+ * (tar streams, existing images). Nodes are kept by their path relative to the root ("" is
+ * the root) and carry the FileEntry they are going to become. source_tree_emit() then puts
+ * the tree into file_list in the same order scan_contents() would have. */
+class SourceNode {
+	public:
+		SourceNode() {
+			is_dir = 0;
+		}
+	public:
+		int		is_dir;
+		FileEntry	fe;			/* everything but id and parent */
+		list<string>	children;		/* full paths, in the order they were added */
+};
 
-	for (i=1;i < argc;) {
-		char *a = argv[i++];
+static map<string,SourceNode>	source_nodes;
+
+/* find or create the node for a path, creating the parent directories it implies */
+static SourceNode *source_node(const string &path,int is_dir) {
+	map<string,SourceNode>::iterator i = source_nodes.find(path);
+	if (i != source_nodes.end())
+		return &i->second;
+
+	size_t slash = path.rfind('/');
+	string parent = (slash == string::npos) ? string("") : path.substr(0,slash);
+	if (path.length() > 0) source_node(parent,1)->children.push_back(path);
+
+	SourceNode *n = &source_nodes[path];
+	n->is_dir = is_dir;
+	n->fe.name = (slash == string::npos) ? path : path.substr(slash+1);
+	n->fe.path = parent;
+	n->fe.abspath = path;
+	UDF_timestamp_set(n->fe.file_atime,build_time);
+	UDF_timestamp_set(n->fe.file_ctime,build_time);
+	UDF_timestamp_set(n->fe.file_mtime,build_time);
+	return n;
+}
 
-		if (*a == '-' && !forget) {
-			char *sw = a+1;
-			if (*sw == '-') sw++;
+static map<UDF_Uint64,UDF_Uint64>	source_link_ids;	/* hard links: node link key -> id of the first link */
 
-			/* -- means treat further arguments starting with '-' as file names, etc. */
-			if (*sw == 0) {
-				forget = 1;
-			}
-			else if (!strcmp(sw,"limit")) {
-				char *e = argv[i++];
-				if (!e) continue;
-				iso_size_limit = metric_atoi(e);
-			}
-			else if (!strcmp(sw,"o")) {
-				char *e = argv[i++];
-				if (!e) continue;
-				if (*e == '/')	iso_file = e;
-				else		iso_file = invoked_root + string("/") + string(e);
-			}
-			else if (!strcmp(sw,"report")) {
-				char *e = argv[i++];
-				if (!e) continue;
-				if (*e == '/')	report_file = e;
-				else		report_file = invoked_root + string("/") + string(e);
-			}
-			else if (!strcmp(sw,"hashes")) {
-				char *e = argv[i++];
-				if (!e) continue;
-				if (*e == '/')	hashtable_file = e;
-				else		hashtable_file = invoked_root + string("/") + string(e);
-			}
-			else if (!strcmp(sw,"gap")) {
-				char *e = argv[i++];
-				if (!e) continue;
-				if (*e == '/')	gap_file = e;
-				else		gap_file = invoked_root + string("/") + string(e);
-			}
-			else if (!strcmp(sw,"sparse")) {
-				auto_sparse_detect = 1;
+/* all children of a directory get consecutive IDs, then the subdirectories are visited */
+static int source_tree_emit(const string &dirpath,UDF_Uint64 dir_id) {
+	SourceNode *d = &source_nodes[dirpath];
+	list< pair<UDF_Uint64,string> > subdirs;
+	list<string>::iterator ci;
+	int idcount = 0,dir_bytes = 40;
+
+	for (ci=d->children.begin();ci != d->children.end();ci++) {
+		SourceNode *n = &source_nodes[*ci];
+
+		UDF_Uint64 id = file_list_alloc();
+		FileEntry *fl = &file_list[id];
+		*fl = n->fe;
+		fl->id = id;
+		fl->parent = dir_id;
+		fl->characteristics = n->is_dir ? 2 : 0;
+
+		/* the nodes of hard links carry a key of their own, the first link emitted gives its id */
+		if (fl->link_id) {
+			map<UDF_Uint64,UDF_Uint64>::iterator li =
+				source_link_ids.insert(pair<UDF_Uint64,UDF_Uint64>(fl->link_id,id)).first;
+			fl->link_id = li->second;
+		}
+
+		if (n->is_dir) {
+			fl->file_size = 0;
+			fl->src_fd = -1;
+			fl->fixed_start = 0;
+			fl->link_id = 0;
+			subdirs.push_back(pair<UDF_Uint64,string>(id,*ci));
+		}
+		else if (fl->link_id && fl->link_id != id) {
+			/* another link to a file already emitted: only a FID */
+			dir_bytes += UDF_file_identifier_size(fl);
+			if (idcount == 0) parent_dir_to_first_file[dir_id] = id;
+			idcount++;
+			continue;
+		}
+		else {
+			file_list_total += fl->file_size;
+			if (fl->fixed_start && fl->file_size >= FE_EMBED_MAX) {
+				/* already in the ISO: reserve the sectors before any metadata is laid out */
+				OutputExtent *e = NewOutputExtent(fl->fixed_start,(fl->file_size + 2047ULL) >> 11ULL);
+				e->prewritten = 1;
 			}
-			else if (!strcmp(sw,"force-iso")) {
-				iso_overwrite = 1;
+			else {
+				fl->fixed_start = 0;
+			}
+		}
+
+		if (idcount == 0) parent_dir_to_first_file[dir_id] = id;
+		idcount++;
+
+		/* files kept from the image being appended to take nothing new, data already in
+		 * the ISO (tar in place) has been checked against the limit as it came in */
+		if (!fl->existing_fe) file_list_sectors += 1 + ((fl->fixed_start || dedupe_files || auto_sparse_detect) ? 0 : file_data_sectors(fl));
+		dir_bytes += UDF_file_identifier_size(fl);
+	}
+
+	file_list_sectors += directory_sectors(dir_bytes,dir_id == 0);
+	if (plan_over_limit())
+		return 0;
+
+	list< pair<UDF_Uint64,string> >::iterator si;
+	for (si=subdirs.begin();si != subdirs.end();si++)
+		if (!source_tree_emit(si->second,si->first))
+			return 0;
+
+	return 1;
+}
+
+/* tar/pax input. Only the headers go into the file table. The member data is spooled as it
+ * streams in: straight to its final sectors in the ISO when the ISO is a regular file (the
+ * UDF metadata is then laid out around it; the members small enough to be embedded in their
+ * File Entry go to a temporary file), into a temporary file otherwise. Either way the
+ * data is never extracted to disk and read back. The directory hierarchy is built from the
+ * member paths once the whole stream has been read, since tar does not keep siblings together
+ * (or even list the directories at all). */
+static int			tar_spool_fd = -1;
+static UDF_Uint64		tar_spool_pos = 0;	/* byte offset (temporary file) or sector (in place) */
+static char			tar_in_place = 0;
+static int			tar_small_fd = -1;	/* in place: the members embedded in their File Entry */
+static UDF_Uint64		tar_small_pos = 0;	/* byte offset */
+
+/* read exactly len bytes, unless the stream ends */
+static int read_full(int fd,void *buf,int len) {
+	int got = 0;
+	while (got < len) {
+		int rd = read(fd,((unsigned char*)buf)+got,len-got);
+		if (rd < 0 && errno == EINTR) continue;
+		if (rd <= 0) break;
+		got += rd;
+	}
+	return got;
+}
+
+/* numeric header field: octal, or GNU base-256 if the top bit is set (for sizes >= 8GB) */
+static UDF_Uint64 tar_number(const unsigned char *p,int len) {
+	UDF_Uint64 v = 0;
+	int i;
+
+	if (p[0] & 0x80) {
+		v = p[0] & 0x7F;
+		for (i=1;i < len;i++) v = (v << 8ULL) | p[i];
+		return v;
+	}
+
+	for (i=0;i < len && (p[i] == ' ' || p[i] == 0);i++);
+	for (;i < len && p[i] >= '0' && p[i] <= '7';i++) v = (v << 3ULL) + (p[i] - '0');
+	return v;
+}
+
+/* clean up a member path: no leading "./" or "/", no empty or "." elements, no trailing '/'.
+ * returns 0 if the path tries to escape with ".." */
+static int tar_clean_path(const string &in,string &out) {
+	const char *x = in.c_str();
+	out = "";
+
+	while (*x) {
+		while (*x == '/') x++;
+		const char *e = strchr(x,'/');
+		if (!e) e = x + strlen(x);
+		string elem = string(x,(int)(e-x));
+		x = e;
+
+		if (elem == "" || elem == ".") continue;
+		if (elem == "..") return 0;
+		if (out.length() > 0) out += "/";
+		out += elem;
+	}
+
+	return 1;
+}
+
+/* -exclude/-include for a member path. a tar can list a member long after (or without) its
+ * directories, so every parent directory is checked too, each one only once */
+static map<string,int>	tar_rules_dirs;		/* directory path -> 1 if excluded */
+
+static int tar_excluded(const string &path,int is_dir) {
+	size_t slash = path.rfind('/');
+
+	if (slash != string::npos) {
+		string parent = path.substr(0,slash);
+		map<string,int>::iterator i = tar_rules_dirs.find(parent);
+		if (i == tar_rules_dirs.end())
+			i = tar_rules_dirs.insert(pair<string,int>(parent,tar_excluded(parent,1))).first;
+		if (i->second)
+			return 1;
+	}
+
+	return scan_rules_exclude(path.c_str() + (slash == string::npos ? 0 : slash+1),path,is_dir);
+}
+
+/* pax extended header records: "<length> <key>=<value>\n" */
+static void tar_pax_parse(const string &data,map<string,string> &kv) {
+	size_t o = 0;
+	while (o < data.length()) {
+		size_t sp = data.find(' ',o);
+		if (sp == string::npos) break;
+		unsigned long reclen = strtoul(data.c_str()+o,NULL,10);
+		if (reclen == 0 || (o+reclen) > data.length()) break;
+		string rec = data.substr(sp+1,(o+reclen)-(sp+1));
+		if (rec.length() > 0 && rec[rec.length()-1] == '\n') rec = rec.substr(0,rec.length()-1);
+		size_t eq = rec.find('=');
+		if (eq != string::npos) kv[rec.substr(0,eq)] = rec.substr(eq+1);
+		o += reclen;
+	}
+}
+
+static UDF_Uint64	tar_link_keys = 0;	/* hard links: the key of the last target that got one */
+
+/* copy one member's data from the stream into the spool, followed by skipping the tar padding */
+static int tar_spool(int fd,UDF_Uint64 size,FileEntry *f) {
+	static unsigned char buf[1 << 20];
+	UDF_Uint64 rem = size;
+	UDF_Uint64 out;
+
+	f->src_fd = tar_spool_fd;
+	if (tar_in_place && size < FE_EMBED_MAX) {
+		/* it's going to be embedded in its File Entry, it takes no sectors of the ISO. read_file_head()
+		 * reads it from a temporary file instead */
+		if (tar_small_fd < 0 && !print_size) {
+			FILE *tmp = tmpfile();
+			if (!tmp) {
+				fprintf(stderr,"Cannot create a temporary file to spool the tar data: %s\n",strerror(errno));
+				return 0;
+			}
+			tar_small_fd = fileno(tmp);
+		}
+		f->src_fd = tar_small_fd;
+		out = tar_small_pos;
+		tar_small_pos += size;
+	}
+	else if (tar_in_place) {
+		f->fixed_start = tar_spool_pos;
+		out = tar_spool_pos << 11ULL;
+		tar_spool_pos += (size + 2047ULL) >> 11ULL;
+
+		/* it's going to stay there */
+		if (iso_size_limit && (tar_spool_pos << 11ULL) > iso_size_limit) {
+			cerr << "ERROR: The ISO would exceed the limit you specified" << endl;
+			return 0;
+		}
+	}
+	else {
+		out = tar_spool_pos;
+		tar_spool_pos += size;
+	}
+	f->src_offset = out;
+
+	while (rem > 0) {
+		int want = (rem > sizeof(buf)) ? (int)sizeof(buf) : (int)rem;
+		int rd = read_full(fd,buf,want);
+		if (rd < want) {
+			fprintf(stderr,"tar stream ends in the middle of a file\n");
+			return 0;
+		}
+		if (!print_size && pwrite64(f->src_fd,buf,rd,out) != rd) {
+			fprintf(stderr,"Cannot spool tar data: %s\n",strerror(errno));
+			return 0;
+		}
+		out += rd;
+		rem -= rd;
+	}
+
+	int pad = (int)((512 - (size & 511)) & 511);
+	if (pad > 0 && read_full(fd,buf,pad) < pad) {
+		fprintf(stderr,"tar stream ends in the middle of a file\n");
+		return 0;
+	}
+
+	return 1;
+}
+
+/* skip (or collect, if data != NULL) a member's data, including the padding */
+static int tar_skip(int fd,UDF_Uint64 size,string *data) {
+	unsigned char buf[512];
+	UDF_Uint64 blocks = (size + 511ULL) >> 9ULL;
+	while (blocks-- > 0) {
+		if (read_full(fd,buf,512) < 512) {
+			fprintf(stderr,"tar stream ends in the middle of a member\n");
+			return 0;
+		}
+		if (data) {
+			UDF_Uint64 rem = size - data->length();
+			data->append((char*)buf,rem > 512 ? 512 : (int)rem);
+		}
+	}
+	return 1;
+}
+
+static void tar_attributes(FileEntry *f,const unsigned char *hdr,time_t mtime,time_t atime,time_t ctime) {
+	f->uid = (UDF_Uint32)tar_number(hdr+108,8);
+	f->gid = (UDF_Uint32)tar_number(hdr+116,8);
+	UDF_timestamp_set(f->file_atime,atime);
+	UDF_timestamp_set(f->file_ctime,ctime);
+	UDF_timestamp_set(f->file_mtime,mtime);
+}
+
+static int scan_tar_stream(const char *source) {
+	int fd = 0;
+	if (strcmp(source,"-") && (fd = open64(source,O_RDONLY)) < 0) {
+		fprintf(stderr,"Cannot open tar file %s: %s\n",source,strerror(errno));
+		return 0;
+	}
+
+	/* spool straight into the ISO if we can seek in it and read it back (and it isn't a clone of the
+	 * previous build, see -previous). the data goes after the anchor at 256. -print-size only needs
+	 * to know where the data would go, it isn't kept */
+	{
+		struct stat64 st;
+		if (print_size) {
+			tar_in_place = (previous_image == "" && iso_file != "" && span_capacity == 0) ? 1 : 0;
+			tar_spool_pos = tar_in_place ? 257 : 0;
+		}
+		else if (previous_image == "" && span_capacity == 0 && fstat64(iso_fd,&st) == 0 && S_ISREG(st.st_mode) &&
+			(fcntl(iso_fd,F_GETFL) & O_ACCMODE) == O_RDWR) {
+			tar_in_place = 1;
+			tar_spool_fd = iso_fd;
+			tar_spool_pos = 257;
+		}
+		else {
+			FILE *tmp = tmpfile();
+			if (!tmp) {
+				fprintf(stderr,"Cannot create a temporary file to spool the tar data: %s\n",strerror(errno));
+				return 0;
+			}
+			tar_spool_fd = fileno(tmp);
+			tar_spool_pos = 0;
+		}
+	}
+
+	source_node("",1);
+
+	unsigned char hdr[512];
+	map<string,string> pax_global,pax;
+	string long_name;
+	int zero_blocks = 0;
+	UDF_Uint64 members = 0;
+
+	while (1) {
+		int rd = read_full(fd,hdr,512);
+		if (rd == 0) break;	/* no end-of-archive marker, be lenient */
+		if (rd < 512) {
+			fprintf(stderr,"tar stream ends in the middle of a header\n");
+			return 0;
+		}
+
+		{
+			int i,zero = 1;
+			for (i=0;i < 512 && zero;i++) if (hdr[i]) zero = 0;
+			if (zero) {
+				if (++zero_blocks == 2) break;
+				continue;
+			}
+			zero_blocks = 0;
+		}
+
+		/* header checksum: sum of all bytes with the checksum field counted as spaces */
+		{
+			unsigned int sum = 0;
+			int i;
+			for (i=0;i < 512;i++) sum += (i >= 148 && i < 156) ? ' ' : hdr[i];
+			if (sum != (unsigned int)tar_number(hdr+148,8)) {
+				fprintf(stderr,"tar header checksum mismatch, this is not a tar stream or it is damaged\n");
+				return 0;
+			}
+		}
+
+		char type = hdr[156];
+		UDF_Uint64 size = tar_number(hdr+124,12);
+
+		/* headers that describe the next member */
+		if (type == 'x' || type == 'g') {
+			string data;
+			if (!tar_skip(fd,size,&data)) return 0;
+			tar_pax_parse(data,type == 'g' ? pax_global : pax);
+			continue;
+		}
+		if (type == 'L') {
+			if (!tar_skip(fd,size,&long_name)) return 0;
+			while (long_name.length() > 0 && long_name[long_name.length()-1] == 0)
+				long_name = long_name.substr(0,long_name.length()-1);
+			continue;
+		}
+		if (type == 'K') {
+			if (!tar_skip(fd,size,NULL)) return 0;
+			continue;
+		}
+
+		/* pax records override the header, the global ones apply to all members */
+		map<string,string> kv = pax_global;
+		{
+			map<string,string>::iterator pi;
+			for (pi=pax.begin();pi != pax.end();pi++) kv[pi->first] = pi->second;
+		}
+
+		string name;
+		if (kv.find("path") != kv.end()) {
+			name = kv["path"];
+		}
+		else if (long_name.length() > 0) {
+			name = long_name;
+		}
+		else {
+			name = string((char*)hdr,strnlen((char*)hdr,100));
+			if (!memcmp(hdr+257,"ustar",5) && hdr[345] != 0)
+				name = string((char*)hdr+345,strnlen((char*)hdr+345,155)) + string("/") + name;
+		}
+		if (kv.find("size") != kv.end())
+			size = strtoull(kv["size"].c_str(),NULL,10);
+
+		time_t mtime = (time_t)tar_number(hdr+136,12);
+		if (kv.find("mtime") != kv.end()) mtime = (time_t)strtoll(kv["mtime"].c_str(),NULL,10);
+		time_t atime = mtime,ctime = mtime;
+		if (kv.find("atime") != kv.end()) atime = (time_t)strtoll(kv["atime"].c_str(),NULL,10);
+		if (kv.find("ctime") != kv.end()) ctime = (time_t)strtoll(kv["ctime"].c_str(),NULL,10);
+
+		pax.clear();
+		long_name = "";
+
+		string path;
+		if (!tar_clean_path(name,path)) {
+			fprintf(stderr,"%s leads outside of the archive root, ignoring\n",name.c_str());
+			if (!tar_skip(fd,size,NULL)) return 0;
+			continue;
+		}
+		if (path.length() > 0 && !scan_rules.empty() && tar_excluded(path,type == '5' ? 1 : 0)) {
+			if (!tar_skip(fd,size,NULL)) return 0;
+			continue;
+		}
+
+		if (type == '5') {
+			if (path.length() > 0) {
+				SourceNode *n = source_node(path,1);
+				if (!n->is_dir) {
+					fprintf(stderr,"%s: directory replaces a file of the same name\n",path.c_str());
+					n->is_dir = 1;
+				}
+				tar_attributes(&n->fe,hdr,mtime,atime,ctime);
+			}
+			if (!tar_skip(fd,size,NULL)) return 0;
+		}
+		else if (type == '0' || type == 0 || type == '7' || type == '1') {
+			SourceNode *target = NULL;
+			if (type == '1') {
+				/* hard link: refer to the data the target was spooled to */
+				string target_path,linkname = string((char*)hdr+157,strnlen((char*)hdr+157,100));
+				if (kv.find("linkpath") != kv.end()) linkname = kv["linkpath"];
+				map<string,SourceNode>::iterator ti;
+				if (tar_clean_path(linkname,target_path) && (ti = source_nodes.find(target_path)) != source_nodes.end() &&
+					!ti->second.is_dir)
+					target = &ti->second;
+			}
+
+			if (path.length() == 0 || (type == '1' && target == NULL) ||
+				(source_nodes.find(path) != source_nodes.end() && source_nodes[path].is_dir)) {
+				if (path.length() == 0)
+					fprintf(stderr,"tar member without a name, ignoring\n");
+				else if (type == '1')
+					fprintf(stderr,"%s: hard link to a file that is not in the stream (or excluded), ignoring\n",path.c_str());
+				else
+					fprintf(stderr,"%s: a file cannot replace a directory, ignoring\n",path.c_str());
+				if (!tar_skip(fd,size,NULL)) return 0;
+				continue;
+			}
+
+			SourceNode *n = source_node(path,0);
+			n->fe.abspath = string("tar:") + path;
+			tar_attributes(&n->fe,hdr,mtime,atime,ctime);
+
+			if (target) {
+				n->fe.file_size = target->fe.file_size;
+				n->fe.src_fd = target->fe.src_fd;
+				n->fe.src_offset = target->fe.src_offset;
+				n->fe.fixed_start = target->fe.fixed_start;
+				if (!target->fe.link_id) target->fe.link_id = ++tar_link_keys;
+				n->fe.link_id = target->fe.link_id;
+				if (!tar_skip(fd,size,NULL)) return 0;
+			}
+			else {
+				n->fe.file_size = size;
+				n->fe.link_id = 0;
+				if (!tar_spool(fd,size,&n->fe)) return 0;
+			}
+			members++;
+		}
+		else {
+			if (type == '2')
+				fprintf(stderr,"%s is a symbolic link, which is not supported yet\n",path.c_str());
+			else
+				fprintf(stderr,"%s is not a file, ignoring\n",path.c_str());
+			if (!tar_skip(fd,size,NULL)) return 0;
+		}
+	}
+
+	if (fd != 0)
+		close(fd);
+
+	if (isatty(1))
+		cout << "* " << members << " files in the tar stream" << endl;
+
+	if (!source_tree_emit("",0))
+		return 0;
+	return 1;
+}
+
+/* d-string or File Identifier: compression ID 8 (8-bit) or 16 (UCS-2, big endian, made UTF-8 here) */
+static string UDF_decode_name(const unsigned char *p,int len) {
+	string s;
+	int i;
+
+	if (len < 1) return s;
+	if (p[0] == 16) {
+		for (i=1;(i+1) < len;i+=2) {
+			unsigned int c = (p[i] << 8) | p[i+1];
+			if (c < 0x80) {
+				s += (char)c;
+			}
+			else if (c < 0x800) {
+				s += (char)(0xC0 | (c >> 6));
+				s += (char)(0x80 | (c & 0x3F));
+			}
+			else {
+				s += (char)(0xE0 | (c >> 12));
+				s += (char)(0x80 | ((c >> 6) & 0x3F));
+				s += (char)(0x80 | (c & 0x3F));
+			}
+		}
+	}
+	else {
+		s = string((const char*)p+1,len-1);
+	}
+
+	return s;
+}
+
+/* Reading back existing UDF images, mkudfiso's own and other simple ones: a single partition,
+ * and maybe a UDF 2.50 metadata partition in it, 2048 byte blocks, (Extended) File Entries
+ * with short_ad, long_ad or embedded data. */
+class UDFImageFile {
+	public:
+		UDFImageFile() {
+			lbn = 0;
+			file_type = 0;
+			size = 0;
+			embedded = 0;
+			embedded_offset = 0;
+			contiguous = 1;
+			uid = gid = 0;
+			link_count = 1;
+		}
+	public:
+		UDF_Uint32	lbn;			/* where the File Entry is (partition relative) */
+		int		file_type;		/* ICB file type: 4=directory, 5=file */
+		UDF_Uint64	size;
+		int		embedded;		/* the data is inside the File Entry, at embedded_offset (bytes) */
+		UDF_Uint64	embedded_offset;
+		list< pair<UDF_Uint64,UDF_Uint64> > extents;	/* recorded extents as (sector, bytes) */
+		int		contiguous;		/* all of the data is in one run of sectors */
+		UDF_timestamp	atime,mtime,ctime;
+		UDF_Uint32	uid,gid;
+		UDF_Uint16	link_count;
+};
+
+class UDFImage {
+	public:
+		UDFImage() {
+			fd = -1;
+			partition_start = partition_length = 0;
+			fsd_lbn = root_lbn = 0;
+			fsd_ref = root_ref = 0;
+			meta_ref = -1;
+			vds_start = vds_sectors = 0;
+		}
+	public:
+		int		fd;
+		string		path;
+		UDF_Uint32	partition_start,partition_length;
+		UDF_Uint32	fsd_lbn;		/* File Set Descriptor (partition relative) */
+		UDF_Uint32	root_lbn;		/* root directory File Entry (partition relative) */
+		UDF_Uint16	fsd_ref,root_ref;	/* and the partition (reference) they're in */
+		int		meta_ref;		/* the partition reference of the metadata partition, -1 = none */
+		list< pair<UDF_Uint64,UDF_Uint64> > meta_extents,mirror_extents;	/* its sectors as (sector, count) */
+		UDF_Uint32	vds_start,vds_sectors;	/* main Volume Descriptor Sequence */
+		UDF_Uint64	sectors;		/* size of the image */
+		string		volume_id;
+	public:
+		int read_sector(UDF_Uint64 sector,unsigned char *buf) {
+			return pread64(fd,buf,2048,sector << 11ULL) == 2048;
+		}
+		/* read a sector and check that it holds an intact descriptor with the given tag */
+		int read_descriptor(UDF_Uint64 sector,UDF_Uint32 location,UDF_Uint16 id,unsigned char *buf) {
+			if (!read_sector(sector,buf))
+				return 0;
+
+			UDF_tag *tag = (UDF_tag*)buf;
+			unsigned char checksum = 0;
+			int i;
+			for (i=0;i <= 15;i++) if (i != 4) checksum += buf[i];
+			if (tag->TagIdentifier != id || tag->TagChecksum != checksum || tag->TagLocation != location)
+				return 0;
+			if (tag->DescriptorCRCLength > (2048-16) ||
+				osta_cksum(buf+16,tag->DescriptorCRCLength) != tag->DescriptorCRC)
+				return 0;
+
+			return 1;
+		}
+		/* the sector of a logical block, 0 if the partition doesn't have it */
+		UDF_Uint64 block_sector(UDF_Uint32 lbn,UDF_Uint16 ref) {
+			return ((int)ref == meta_ref) ? map_block(meta_extents,lbn) : (partition_start + lbn);
+		}
+		/* where the metadata mirror has a copy of it, 0 if it doesn't */
+		UDF_Uint64 mirror_sector(UDF_Uint32 lbn,UDF_Uint16 ref) {
+			return ((int)ref == meta_ref) ? map_block(mirror_extents,lbn) : 0;
+		}
+		int open(const char *p);
+		int read_file_entry(UDF_Uint32 lbn,UDFImageFile &f,UDF_Uint16 ref=0);
+		int read_data(UDFImageFile &f,string &out);
+	private:
+		UDF_Uint64 map_block(const list< pair<UDF_Uint64,UDF_Uint64> > &extents,UDF_Uint32 lbn) {
+			list< pair<UDF_Uint64,UDF_Uint64> >::const_iterator i;
+			for (i=extents.begin();i != extents.end();i++) {
+				if (lbn < i->second) return i->first + lbn;
+				lbn -= i->second;
+			}
+			return 0;
+		}
+		int read_metadata_file(UDF_Uint32 lbn,list< pair<UDF_Uint64,UDF_Uint64> > &extents);
+};
+
+/* the metadata partition's sectors, from the metadata (mirror) file's Extended File Entry */
+int UDFImage::read_metadata_file(UDF_Uint32 lbn,list< pair<UDF_Uint64,UDF_Uint64> > &extents) {
+	unsigned char buf[2048];
+
+	extents.clear();
+	if (!read_descriptor(partition_start+lbn,lbn,UDFtag_ExtendedFileEntry,buf))
+		return 0;
+
+	UDF_tag_extended_file_entry_descriptor *efe = (UDF_tag_extended_file_entry_descriptor*)buf;
+	UDF_Uint32 o = 216 + efe->LengthOfExtendedAttributes;
+	UDF_Uint32 end = o + efe->LengthOfAllocationDescriptors;
+	if (end > 2048 || (efe->ICBTag.Flags & 7) != 0)
+		return 0;
+
+	for (;(o + 8) <= end;o += 8) {
+		UDF_Uint32 len = LGETDWORD(buf+o);
+		UDF_Uint32 pos = LGETDWORD(buf+o+4);
+		if ((len & 0x3FFFFFFF) == 0 || (len >> 30) != 0) break;
+		extents.push_back(pair<UDF_Uint64,UDF_Uint64>(partition_start + pos,(len & 0x3FFFFFFF) >> 11));
+	}
+
+	return !extents.empty();
+}
+
+int UDFImage::open(const char *p) {
+	UDF_Uint32 meta_file_lbn = 0,mirror_file_lbn = 0;
+	unsigned char buf[2048];
+
+	path = p;
+	if ((fd = open64(p,O_RDONLY)) < 0) {
+		fprintf(stderr,"Cannot open image %s: %s\n",p,strerror(errno));
+		return 0;
+	}
+	sectors = (lseek64(fd,0,SEEK_END) + 2047ULL) >> 11ULL;
+
+	if (!read_descriptor(256,256,UDFtag_AnchorVolumeDescriptor,buf)) {
+		fprintf(stderr,"%s: no UDF anchor at sector 256\n",p);
+		return 0;
+	}
+	{
+		UDF_tag_anchor_volume_descriptor *anchor = (UDF_tag_anchor_volume_descriptor*)buf;
+		vds_start = anchor->MainVolumeDescriptorSequenceExtent.location;
+		vds_sectors = anchor->MainVolumeDescriptorSequenceExtent.length >> 11;
+	}
+
+	int have_partition = 0,have_volume = 0;
+	UDF_Uint32 i;
+	for (i=0;i < vds_sectors;i++) {
+		if (!read_sector(vds_start+i,buf)) break;
+		UDF_tag *tag = (UDF_tag*)buf;
+
+		if (tag->TagIdentifier == UDFtag_TerminatingDescriptor) {
+			break;
+		}
+		else if (tag->TagIdentifier == UDFtag_PartitionDescriptor) {
+			if (!read_descriptor(vds_start+i,vds_start+i,UDFtag_PartitionDescriptor,buf)) break;
+			UDF_tag_partition_descriptor *pd = (UDF_tag_partition_descriptor*)buf;
+			partition_start = pd->PartitionStartingLocation;
+			partition_length = pd->PartitionLength;
+			have_partition = 1;
+		}
+		else if (tag->TagIdentifier == UDFtag_LogicalVolumeDescriptor) {
+			if (!read_descriptor(vds_start+i,vds_start+i,UDFtag_LogicalVolumeDescriptor,buf)) break;
+			UDF_tag_logical_volume_descriptor *lv = (UDF_tag_logical_volume_descriptor*)buf;
+			if (lv->LogicalBlockSize != 2048) {
+				fprintf(stderr,"%s: logical block size %u is not supported\n",p,lv->LogicalBlockSize);
+				return 0;
+			}
+			volume_id = UDF_decode_name(lv->LogicalVolumeIdentifier,
+				lv->LogicalVolumeIdentifier[sizeof(lv->LogicalVolumeIdentifier)-1]);
+			/* the File Set Descriptor is a long_ad in the Logical Volume Contents Use field */
+			fsd_lbn = ((UDF_long_ad*)(lv->LogicalVolumeContentsUse))->ExtentLocation.LogicalBlockNumber;
+			fsd_ref = ((UDF_long_ad*)(lv->LogicalVolumeContentsUse))->ExtentLocation.PartitionReferenceNumber;
+			have_volume = 1;
+
+			/* a metadata partition (UDF 2.50) among the partition maps? */
+			UDF_Uint32 m,o = 0;
+			for (m=0;m < lv->NumberOfPartitionMaps && o < lv->MapTableLength && (440 + o + 64) <= 2048;m++) {
+				UDF_partition_map_metadata *pmm = (UDF_partition_map_metadata*)(lv->PartitionMaps + o);
+				if (pmm->PartitionMapType == 2 &&
+					!memcmp(pmm->PartitionTypeIdentifier.Identifier,"*UDF Metadata Partition",23)) {
+					meta_ref = m;
+					meta_file_lbn = pmm->MetadataFileLocation;
+					mirror_file_lbn = pmm->MetadataMirrorFileLocation;
+				}
+				if (pmm->PartitionMapLength == 0) break;
+				o += pmm->PartitionMapLength;
+			}
+		}
+	}
+	if (!have_partition || !have_volume) {
+		fprintf(stderr,"%s: incomplete volume descriptor sequence\n",p);
+		return 0;
+	}
+
+	/* the metadata partition is wherever the metadata file says, or if that's damaged, its mirror */
+	if (meta_ref >= 0) {
+		read_metadata_file(mirror_file_lbn,mirror_extents);
+		if (!read_metadata_file(meta_file_lbn,meta_extents)) {
+			fprintf(stderr,"%s: bad metadata file, using the mirror\n",p);
+			meta_extents = mirror_extents;
+		}
+		if (meta_extents.empty()) {
+			fprintf(stderr,"%s: no readable metadata partition\n",p);
+			return 0;
+		}
+	}
+
+	UDF_Uint64 sector = block_sector(fsd_lbn,fsd_ref);
+	if (!sector || !read_descriptor(sector,fsd_lbn,UDFtag_FileSetDescriptor,buf)) {
+		fprintf(stderr,"%s: bad File Set Descriptor\n",p);
+		return 0;
+	}
+	root_lbn = ((UDF_tag_file_set_descriptor*)buf)->RootDirectoryICB.ExtentLocation.LogicalBlockNumber;
+	root_ref = ((UDF_tag_file_set_descriptor*)buf)->RootDirectoryICB.ExtentLocation.PartitionReferenceNumber;
+	return 1;
+}
+
+int UDFImage::read_file_entry(UDF_Uint32 lbn,UDFImageFile &f,UDF_Uint16 ref) {
+	UDF_Uint64 fe_sector = block_sector(lbn,ref);
+	unsigned char buf[2048];
+
+	if (!fe_sector || (!read_descriptor(fe_sector,lbn,UDFtag_FileEntry,buf) &&
+		!read_descriptor(fe_sector,lbn,UDFtag_ExtendedFileEntry,buf))) {
+		fprintf(stderr,"%s: bad File Entry at block %u\n",path.c_str(),lbn);
+		return 0;
+	}
+
+	/* an Extended File Entry is the same up to the information length */
+	UDF_tag_file_entry_descriptor *fe = (UDF_tag_file_entry_descriptor*)buf;
+	UDF_tag_extended_file_entry_descriptor *efe = (UDF_tag_extended_file_entry_descriptor*)buf;
+	int extended = (fe->DescriptorTag.TagIdentifier == UDFtag_ExtendedFileEntry);
+	f.lbn = lbn;
+	f.file_type = fe->ICBTag.FileType;
+	f.size = fe->InformationLength;
+	f.atime = extended ? efe->AccessDateAndTime : fe->AccessDateAndTime;
+	f.mtime = extended ? efe->ModificationDateAndTime : fe->ModificationDateAndTime;
+	f.ctime = extended ? efe->AttributeDateAndTime : fe->AttributeDateAndTime;
+	f.uid = fe->Uid;
+	f.gid = fe->Gid;
+	f.link_count = fe->FileLinkCount;
+	f.extents.clear();
+	f.contiguous = 1;
+	f.embedded = 0;
+
+	UDF_Uint32 ad_ofs = extended ? (216 + efe->LengthOfExtendedAttributes) : (176 + fe->LengthOfExtendedAttributes);
+	UDF_Uint32 ad_len = extended ? efe->LengthOfAllocationDescriptors : fe->LengthOfAllocationDescriptors;
+	if ((ad_ofs + ad_len) > 2048) {
+		fprintf(stderr,"%s: File Entry at block %u is damaged\n",path.c_str(),lbn);
+		return 0;
+	}
+
+	int ad_type = fe->ICBTag.Flags & 7;
+	if (ad_type == 3) {
+		f.embedded = 1;
+		f.embedded_offset = (fe_sector << 11ULL) + ad_ofs;
+		return 1;
+	}
+	if (ad_type != 0 && ad_type != 1) {
+		fprintf(stderr,"%s: File Entry at block %u uses extended allocation descriptors\n",path.c_str(),lbn);
+		return 0;
+	}
+
+	UDF_Uint64 total = 0,next_sector = 0;
+	UDF_Uint32 o = ad_ofs,step = (ad_type == 0) ? 8 : 16,aeds = 0;
+	while ((o + step) <= (ad_ofs + ad_len) && total < f.size) {
+		UDF_Uint32 len = LGETDWORD(buf+o);
+		UDF_Uint32 pos = LGETDWORD(buf+o+4);
+		UDF_Uint16 pos_ref = (step == 16) ? LGETWORD(buf+o+8) : ref;	/* a short_ad is in the File Entry's partition */
+		o += step;
+
+		UDF_Uint32 type = len >> 30;
+		len &= 0x3FFFFFFF;
+		if (len == 0) break;
+		UDF_Uint64 sector = block_sector(pos,pos_ref);
+		if (type == 3) {
+			/* the allocation descriptors go on in an Allocation Extent Descriptor */
+			if (++aeds > 65536 || !sector || !read_descriptor(sector,pos,UDFtag_AllocationExtentDescriptor,buf)) {
+				fprintf(stderr,"%s: File Entry at block %u has a bad Allocation Extent Descriptor at block %u\n",
+					path.c_str(),lbn,pos);
+				return 0;
+			}
+			ad_ofs = o = 24;
+			ad_len = LGETDWORD(buf+20);
+			if ((ad_ofs + ad_len) > 2048) {
+				fprintf(stderr,"%s: Allocation Extent Descriptor at block %u is damaged\n",path.c_str(),pos);
+				return 0;
+			}
+			continue;
+		}
+		if (type != 0) {
+			/* not recorded: a hole */
+			f.contiguous = 0;
+		}
+		else {
+			if (!sector) {
+				fprintf(stderr,"%s: File Entry at block %u points outside its partition\n",path.c_str(),lbn);
+				return 0;
+			}
+			if (!f.extents.empty() && sector != next_sector) f.contiguous = 0;
+			f.extents.push_back(pair<UDF_Uint64,UDF_Uint64>(sector,len));
+			next_sector = sector + ((len + 2047) >> 11);
+		}
+		total += len;
+	}
+
+	if (total < f.size) {
+		fprintf(stderr,"%s: File Entry at block %u describes less data than the file size\n",path.c_str(),lbn);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* the whole contents of a (small) file, i.e. a directory */
+int UDFImage::read_data(UDFImageFile &f,string &out) {
+	out = "";
+
+	if (f.embedded) {
+		out.resize(f.size);
+		return f.size == 0 || pread64(fd,&out[0],f.size,f.embedded_offset) == (ssize_t)f.size;
+	}
+
+	list< pair<UDF_Uint64,UDF_Uint64> >::iterator ei;
+	for (ei=f.extents.begin();ei != f.extents.end() && out.length() < f.size;ei++) {
+		string chunk;
+		chunk.resize(ei->second);
+		if (pread64(fd,&chunk[0],ei->second,ei->first << 11ULL) != (ssize_t)ei->second)
+			return 0;
+		out += chunk;
+	}
+
+	if (out.length() > f.size) out.resize(f.size);
+	return out.length() == f.size;
+}
+
+/* -from-image: an existing image as the source tree. Files are copied from the image's
+ * extents (with copy_file_range(), which can share the blocks on reflink capable filesystems)
+ * instead of being read from the filesystem. A directory given as well is laid over the image:
+ * its new and changed files are read from disk, files whose size and modification time match
+ * the image are still taken from the image. */
+static string		source_image;
+static UDFImage		source_img;
+static UDF_Uint64	source_image_files = 0;
+
+/* copy len bytes between two files at the given offsets with copy_file_range(), which shares the
+ * blocks instead of copying them where the filesystem can (btrfs, XFS, ...). returns 1 if copied,
+ * -1 on error, 0 if the kernel or filesystem can't do it, in which case it is not tried again */
+static int		iso_copy_range = 1;
+
+static int copy_range(int in_fd,UDF_Uint64 in_ofs,int out_fd,UDF_Uint64 out_ofs,UDF_Uint64 len) {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+	loff_t ip = in_ofs,op = out_ofs;
+	UDF_Uint64 done = 0;
+
+	while (done < len) {
+		ssize_t r = copy_file_range(in_fd,&ip,out_fd,&op,len - done,0);
+		if (r < 0 && errno == EINTR) continue;
+		if (r <= 0) {
+			if (done == 0 && (r == 0 || errno == ENOSYS || errno == EXDEV ||
+				errno == EINVAL || errno == EOPNOTSUPP || errno == EBADF)) {
+				iso_copy_range = 0;
+				return 0;
+			}
+			if (r == 0) errno = EIO;
+			return -1;
+		}
+		done += r;
+	}
+
+	return 1;
+#else
+	iso_copy_range = 0;
+	return 0;
+#endif
+}
+
+static int image_load_tree(UDFImage &img,UDF_Uint32 dir_lbn,UDF_Uint16 dir_ref,const string &relbase,map<UDF_Uint32,int> &visited) {
+	UDFImageFile dir;
+	string data;
+
+	if (visited.find(dir_lbn) != visited.end()) {
+		fprintf(stderr,"%s: directory loop at block %u\n",img.path.c_str(),dir_lbn);
+		return 0;
+	}
+	visited[dir_lbn] = 1;
+
+	if (!img.read_file_entry(dir_lbn,dir,dir_ref) || !img.read_data(dir,data)) {
+		fprintf(stderr,"%s: cannot read directory /%s\n",img.path.c_str(),relbase.c_str());
+		return 0;
+	}
+
+	const unsigned char *raw = (const unsigned char*)data.data();
+	UDF_Uint32 o = 0;
+	while ((o + 38) <= data.length()) {
+		UDF_tag_file_identifier_descriptor *fid = (UDF_tag_file_identifier_descriptor*)(raw + o);
+		if (fid->DescriptorTag.TagIdentifier != UDFtag_FileIdentifierDescriptor) {
+			fprintf(stderr,"%s: damaged directory /%s\n",img.path.c_str(),relbase.c_str());
+			return 0;
+		}
+
+		UDF_Uint32 sz = (38 + fid->LengthOfImplementationUse + fid->LengthOfFileIdentifier + 3) & (~3);
+		UDF_Uint8 chars = fid->FileCharacteristics;
+		string name = UDF_decode_name(raw + o + 38 + fid->LengthOfImplementationUse,fid->LengthOfFileIdentifier);
+		UDF_Uint32 lbn = fid->ICB.ExtentLocation.LogicalBlockNumber;
+		UDF_Uint16 ref = fid->ICB.ExtentLocation.PartitionReferenceNumber;
+		o += sz;
+
+		if ((chars & 8) || (chars & 4) || name.length() == 0)
+			continue;	/* parent, deleted */
+
+		string rel = relbase.length() > 0 ? (relbase + string("/") + name) : name;
+		if (!scan_rules.empty() && scan_rules_exclude(name.c_str(),rel,(chars & 2) ? 1 : 0))
+			continue;
+
+		UDFImageFile f;
+		if (!img.read_file_entry(lbn,f,ref))
+			return 0;
+
+		if (f.file_type == 4) {
+			SourceNode *n = source_node(rel,1);
+			n->fe.uid = f.uid;
+			n->fe.gid = f.gid;
+			n->fe.file_atime = f.atime;
+			n->fe.file_ctime = f.ctime;
+			n->fe.file_mtime = f.mtime;
+			if (!image_load_tree(img,lbn,ref,rel,visited))
+				return 0;
+		}
+		else if (append_session) {
+			/* the new session refers to the File Entry already in the image, whatever it describes */
+			SourceNode *n = source_node(rel,0);
+			n->fe.abspath = img.path + string(":/") + rel;
+			n->fe.file_size = f.size;
+			n->fe.file_mtime = f.mtime;
+			n->fe.existing_fe = lbn;
+		}
+		else if (f.file_type == 5) {
+			if (!f.embedded && !f.contiguous) {
+				fprintf(stderr,"%s: /%s is fragmented, it can only come from the directory\n",
+					img.path.c_str(),rel.c_str());
+				continue;
+			}
+
+			SourceNode *n = source_node(rel,0);
+			n->fe.abspath = img.path + string(":/") + rel;
+			n->fe.uid = f.uid;
+			n->fe.gid = f.gid;
+			n->fe.file_atime = f.atime;
+			n->fe.file_ctime = f.ctime;
+			n->fe.file_mtime = f.mtime;
+			n->fe.file_size = f.size;
+			n->fe.src_fd = img.fd;
+			n->fe.src_offset = f.embedded ? f.embedded_offset :
+				(f.extents.empty() ? 0 : (f.extents.front().first << 11ULL));
+		}
+		else {
+			fprintf(stderr,"%s: /%s is not a file, ignoring\n",img.path.c_str(),rel.c_str());
+		}
+	}
+
+	return 1;
+}
+
+static int scan_source_image(const char *image) {
+	map<UDF_Uint32,int> visited;
+
+	if (!source_img.open(image))
+		return 0;
+
+	source_node("",1);
+	if (!image_load_tree(source_img,source_img.root_lbn,source_img.root_ref,string(),visited))
+		return 0;
+
+	/* lay the directory over it. it's scanned as usual, then merged into the tree */
+	UDF_Uint64 from_image = 0,from_dir = 0;
+	if (content_root != "") {
+		map<UDF_Uint64,string> rel;
+		map<UDF_Uint64,FileEntry>::iterator i;
+
+		if (scan_contents(content_root.c_str()) < 0)
+			return 0;
+		rel[0] = "";
+		for (i=file_list.begin();i != file_list.end();i++) {
+			FileEntry *fl = &i->second;
+			string r = rel[fl->parent];
+			r = (r.length() > 0) ? (r + string("/") + fl->name) : fl->name;
+			rel[fl->id] = r;
+
+			map<string,SourceNode>::iterator ni = source_nodes.find(r);
+			if (fl->characteristics & 2) {
+				SourceNode *n = source_node(r,1);
+				n->is_dir = 1;
+				continue;
+			}
+
+			if (ni != source_nodes.end() && !ni->second.is_dir &&
+				ni->second.fe.file_size == fl->file_size &&
+				!memcmp(&ni->second.fe.file_mtime,&fl->file_mtime,sizeof(UDF_timestamp)))
+				continue;	/* unchanged, keep the copy in the image */
+
+			SourceNode *n = source_node(r,0);
+			n->is_dir = 0;
+			n->fe = *fl;
+			from_dir++;
+		}
+
+		file_list.clear();
+		parent_dir_to_first_file.clear();
+		file_list_total = 0;
+		file_list_sectors = 0;
+	}
+
+	if (!source_tree_emit("",0))
+		return 0;
+
+	{
+		map<UDF_Uint64,FileEntry>::iterator i;
+		for (i=file_list.begin();i != file_list.end();i++)
+			if (i->second.src_fd == source_img.fd) from_image++;
+	}
+	source_image_files = from_image;
+
+	if (isatty(1))
+		cout << "* " << from_image << " files from " << image << ", " << from_dir << " from the directory" << endl;
+
+	return 1;
+}
+
+/* open a source file for reading. O_NOATIME where we may (our own files), so that reading them
+ * doesn't change the access times the File Entries record */
+static int source_open(const char *path) {
+#ifdef O_NOATIME
+	int fd = open64(path,O_RDONLY|O_NOATIME);
+	if (fd >= 0 || errno != EPERM)
+		return fd;
+#endif
+	return open64(path,O_RDONLY);
+}
+
+/* work shared out among worker processes: job(ctx,i) for every i below n, worker w doing i = w,
+ * w + workers, ... there are as many workers as CPUs (or as asked), at most 16 and at most n. what
+ * they find goes in memory from shared_memory(), which the parent sees. a worker that can't be
+ * started has its share done here. it comes back 0 if any job said so (returned 0) or a worker
+ * didn't finish; what went wrong in a job is for the job to say */
+typedef int (*worker_job)(void *ctx,size_t i);
+
+static void *shared_memory(size_t len) {
+	void *p = mmap(NULL,len,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_ANONYMOUS,-1,0);
+	if (p == MAP_FAILED) {
+		cerr << "Cannot map " << len << " bytes of memory for the worker processes: " << strerror(errno) << endl;
+		return NULL;
+	}
+	memset(p,0,len);
+	return p;
+}
+
+static int worker_share(size_t n,worker_job job,void *ctx,long w,long workers) {
+	size_t i;
+	int ok = 1;
+
+	for (i=w;i < n;i += workers)
+		if (!job(ctx,i)) ok = 0;
+	return ok;
+}
+
+static int run_workers(size_t n,worker_job job,void *ctx,long workers=0) {
+	vector<pid_t> pids;
+	size_t x;
+	long w;
+	int ok = 1;
+
+	if (workers <= 0) workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (workers < 1) workers = 1;
+	if (workers > 16) workers = 16;
+	if ((size_t)workers > n) workers = n;
+	if (workers <= 1) return worker_share(n,job,ctx,0,1);
+
+	cout.flush();
+	cerr.flush();
+	fflush(stdout);
+
+	for (w=0;w < workers;w++) {
+		pid_t pid = fork();
+		if (pid == 0)
+			_exit(worker_share(n,job,ctx,w,workers) ? 0 : 1);
+		if (pid < 0) {
+			/* do it ourselves */
+			if (!worker_share(n,job,ctx,w,workers)) ok = 0;
+			continue;
+		}
+		pids.push_back(pid);
+	}
+	for (x=0;x < pids.size();x++) {
+		int status = 0;
+		if (waitpid(pids[x],&status,0) < 0) {
+			cerr << "Lost worker process " << pids[x] << ": " << strerror(errno) << endl;
+			ok = 0;
+		}
+		else if (WIFSIGNALED(status)) {
+			cerr << "Worker process " << pids[x] << " was killed by signal " << WTERMSIG(status) << endl;
+			ok = 0;
+		}
+		else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			ok = 0;
+	}
+
+	return ok;
+}
+
+/* -source-order: where a file's data starts on its device, by FIEMAP. -1 if the filesystem can't
+ * tell, 0 if it has no blocks */
+static UDF_Uint64 source_physical(int fd) {
+#ifdef FS_IOC_FIEMAP
+	union {
+		struct fiemap		map;
+		unsigned char		raw[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+	} u;
+
+	memset(&u,0,sizeof(u));
+	u.map.fm_start = 0;
+	u.map.fm_length = ~0ULL;
+	u.map.fm_extent_count = 1;
+	if (ioctl(fd,FS_IOC_FIEMAP,&u.map) < 0) return (UDF_Uint64)-1;
+	if (u.map.fm_mapped_extents == 0) return 0;
+	if (u.map.fm_extents[0].fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE))
+		return (UDF_Uint64)-1;
+	return u.map.fm_extents[0].fe_physical;
+#else
+	return (UDF_Uint64)-1;
+#endif
+}
+
+class SourceOrderExtent {
+	public:
+		SourceOrderExtent() {
+			dev = 0;
+			physical = ino = 0;
+			extent = NULL;
+		}
+	public:
+		dev_t		dev;
+		UDF_Uint64	physical;		/* by FIEMAP, or failing that ... */
+		UDF_Uint64	ino;			/* ... the inode number, usually about as good */
+		OutputExtent*	extent;
+	public:
+		bool operator<(const SourceOrderExtent &b) const {
+			if (dev != b.dev) return dev < b.dev;
+			if (physical != b.physical) return physical < b.physical;
+			return ino < b.ino;
+		}
+};
+
+/* copy a file's data into its place in the ISO, the last sector padded with zeros */
+static int source_order_copy(OutputExtent *e,int fd,unsigned char *buf,UDF_Uint64 bufsz) {
+	FileEntry *f = e->file;
+	UDF_Uint64 cp = 0;
+
+	while (cp < f->file_size) {
+		UDF_Uint64 want = f->file_size - cp;
+		if (want > bufsz) want = bufsz;
+
+		ssize_t rd = pread64(fd,buf,want,cp);
+		if (rd < 0 && errno == EINTR) continue;
+		if (rd <= 0) {
+			cerr << "error: i read in " << cp << " bytes when the file was reported as " <<
+				f->file_size << " bytes." << endl;
+			return 0;
+		}
+
+		UDF_Uint64 wr = ((UDF_Uint64)rd + 2047ULL) & (~2047ULL);
+		if (wr > (UDF_Uint64)rd) memset(buf + rd,0,wr - rd);
+		if (pwrite64(iso_fd,buf,wr,(e->start << 11ULL) + cp) != (ssize_t)wr) {
+			fprintf(stderr,"write error: cannot write iso image. %s\n",strerror(errno));
+			return 0;
+		}
+		cp += rd;
+	}
+
+	return 1;
+}
+
+/* -source-order: one device's queue, order[first] up to order[last] */
+static int source_order_queue(vector<SourceOrderExtent> &order,size_t first,size_t last) {
+	UDF_Uint64 bufsz = 1024*1024;
+	unsigned char *buf = new unsigned char[bufsz];
+	size_t x;
+
+	for (x=first;x < last;x++) {
+		OutputExtent *e = order[x].extent;
+		int fd = source_open(e->file->abspath.c_str());
+		if (fd < 0) {
+			cerr << "cannot open file " << e->file->abspath << endl;
+			delete[] buf;
+			return 0;
+		}
+#ifdef POSIX_FADV_SEQUENTIAL
+		posix_fadvise(fd,0,0,POSIX_FADV_SEQUENTIAL);
+#endif
+		int ok = source_order_copy(e,fd,buf,bufsz);
+		close(fd);
+		if (!ok) {
+			delete[] buf;
+			return 0;
+		}
+	}
+
+	delete[] buf;
+	return 1;
+}
+
+class SourceOrderJob {
+	public:
+		vector<SourceOrderExtent>	*order;
+		vector<size_t>			*queues;	/* where each device's queue starts in order, then its end */
+};
+
+static int source_order_job(void *ctx,size_t q) {
+	SourceOrderJob *j = (SourceOrderJob*)ctx;
+	return source_order_queue(*j->order,(*j->queues)[q],(*j->queues)[q+1]);
+}
+
+/* -source-order: reading the files in the order of the image seeks all over a spinning source
+ * disk. so before the ISO is written from start to end, the data of the plain files (not sparse,
+ * not from a spool or image) is copied into place in the order it lies on the source devices.
+ * each device gets a queue of its own, worked by a child process of its own, so that sources
+ * on several disks are read from all of them at once. the extents that were copied are then
+ * prewritten: the writer passes over them, or reads them back from the ISO to hash them. from
+ * is where a resumed build picks up, anything before it is done */
+static int source_order_write(UDF_Uint64 from) {
+	map<UDF_Uint64,OutputExtent>::iterator i;
+	vector<SourceOrderExtent> order;
+	size_t x;
+
+	/* parse_args() wants -o, which makes a new file. make sure it can seek before anything starts */
+	if (lseek64(iso_fd,0,SEEK_CUR) < 0) {
+		cerr << "WARNING: -source-order: the ISO can't be written out of order (" << strerror(errno) <<
+			"), the files are read in the order of the image" << endl;
+		return 1;
+	}
+
+	for (i=output_extents.lower_bound(from);i != output_extents.end();i++) {
+		FileEntry *f = i->second.file;
+		if (!f || i->second.prewritten || i->second.content || f->src_fd >= 0 || !f->holes.empty() || f->file_size == 0)
+			continue;
+
+		struct stat64 st;
+		SourceOrderExtent o;
+		int fd = source_open(f->abspath.c_str());
+		if (fd < 0) continue;	/* it'll be reported when it is written */
+		if (fstat64(fd,&st) == 0) {
+			o.dev = st.st_dev;
+			o.ino = st.st_ino;
+		}
+		o.physical = source_physical(fd);
+		o.extent = &i->second;
+		order.push_back(o);
+		close(fd);
+	}
+	if (order.empty()) return 1;
+	sort(order.begin(),order.end());
+
+	/* the queues: runs of the same device */
+	vector<size_t> queues;
+	for (x=0;x < order.size();x++)
+		if (x == 0 || order[x].dev != order[x-1].dev) queues.push_back(x);
+	queues.push_back(order.size());
+
+	if (isatty(1))
+		cout << "* Copying " << order.size() << " files in the order they are on the source (" <<
+			(queues.size() - 1) << " device" << ((queues.size() > 2) ? "s" : "") << ")" << endl;
+
+	/* a worker per device, however many CPUs there are: they mostly wait for the disks */
+	SourceOrderJob job;
+	job.order = &order;
+	job.queues = &queues;
+	if (!run_workers(queues.size() - 1,source_order_job,&job,queues.size() - 1))
+		return 0;
+
+	for (x=0;x < order.size();x++)
+		order[x].extent->prewritten = 1;
+	return 1;
+}
+
+/* SEEK_DATA/SEEK_HOLE: the holes of a sparse source file read as zeros without being read at
+ * all. Offsets are relative to base (where the file's data starts in fd). Looked up a run at a
+ * time; a filesystem that can't tell says it is all data */
+class SourceMap {
+	public:
+		SourceMap(int f,UDF_Uint64 b,UDF_Uint64 s) {
+			fd = f;
+			base = b;
+			size = s;
+			start = end = 0;
+			hole = 0;
+		}
+	public:
+		/* is all of [ofs,ofs+len) a hole? */
+		int zero(UDF_Uint64 ofs,UDF_Uint64 len) {
+			if (ofs < start || ofs >= end) lookup(ofs);
+			return hole && (ofs + len) <= end;
+		}
+		/* where the run (hole or data) at ofs ends */
+		UDF_Uint64 run_end(UDF_Uint64 ofs) {
+			if (ofs < start || ofs >= end) lookup(ofs);
+			return end;
+		}
+	public:
+		int		fd;
+		UDF_Uint64	base,size;
+		UDF_Uint64	start,end;		/* the run looked up last */
+		int		hole;
+	private:
+		void lookup(UDF_Uint64 ofs) {
+			start = ofs;
+			end = size;
+			hole = 0;
+#ifdef SEEK_DATA
+			/* (the file position is put back, for whoever read()s from fd) */
+			off64_t pos = lseek64(fd,0,SEEK_CUR);
+			off64_t d = lseek64(fd,base + ofs,SEEK_DATA);
+			if (d < 0) {
+				/* a hole up to the end of the file. (or the file got shorter: read it and see) */
+				struct stat64 st;
+				if (errno == ENXIO && fstat64(fd,&st) == 0 && (UDF_Uint64)st.st_size >= (base + size))
+					hole = 1;
+			}
+			else if ((UDF_Uint64)d > (base + ofs)) {
+				hole = 1;
+				if (((UDF_Uint64)d - base) < size) end = (UDF_Uint64)d - base;
+			}
+			else {
+				off64_t h = lseek64(fd,base + ofs,SEEK_HOLE);
+				if (h > d && ((UDF_Uint64)h - base) < size) end = (UDF_Uint64)h - base;
+			}
+			if (pos >= 0) lseek64(fd,pos,SEEK_SET);
+#endif
+		}
+};
+
+/* -sparse: runs of zero sectors in the data are described by "not recorded, not allocated" extents
+ * instead of being stored. Every file with data of its own is read once before the layout and
+ * checked a sector at a time; runs of at least SPARSE_MIN_SECTORS zero sectors become holes. The
+ * last sector is always recorded. The recorded parts are stored one after the other in a single
+ * extent, and the file's digests still see the zeros. */
+#define SPARSE_MIN_SECTORS	16		/* 32KB: shorter runs aren't worth two more short_ads */
+#define SPARSE_CHUNK		(1024*1024)
+
+static int sector_is_zero_c(const unsigned char *p) {
+	const UDF_Uint64 *q = (const UDF_Uint64*)p;
+	UDF_Uint64 a = 0;
+	int i;
+
+	for (i=0;i < (2048/8);i += 4)
+		a |= q[i] | q[i+1] | q[i+2] | q[i+3];
+	return a == 0;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+__attribute__((target("sse2")))
+static int sector_is_zero_sse2(const unsigned char *p) {
+	__m128i a = _mm_setzero_si128();
+	int i;
+
+	for (i=0;i < 2048;i += 64) {
+		a = _mm_or_si128(a,_mm_loadu_si128((const __m128i*)(p+i)));
+		a = _mm_or_si128(a,_mm_loadu_si128((const __m128i*)(p+i+16)));
+		a = _mm_or_si128(a,_mm_loadu_si128((const __m128i*)(p+i+32)));
+		a = _mm_or_si128(a,_mm_loadu_si128((const __m128i*)(p+i+48)));
+	}
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(a,_mm_setzero_si128())) == 0xFFFF;
+}
+
+__attribute__((target("avx2")))
+static int sector_is_zero_avx2(const unsigned char *p) {
+	__m256i a = _mm256_setzero_si256();
+	int i;
+
+	for (i=0;i < 2048;i += 128) {
+		a = _mm256_or_si256(a,_mm256_loadu_si256((const __m256i*)(p+i)));
+		a = _mm256_or_si256(a,_mm256_loadu_si256((const __m256i*)(p+i+32)));
+		a = _mm256_or_si256(a,_mm256_loadu_si256((const __m256i*)(p+i+64)));
+		a = _mm256_or_si256(a,_mm256_loadu_si256((const __m256i*)(p+i+96)));
+	}
+	return _mm256_testz_si256(a,a);
+}
+#endif
+
+/* the widest the CPU has, picked once */
+static int (*sector_is_zero)(const unsigned char *p) = sector_is_zero_c;
+
+static void sector_is_zero_init() {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		sector_is_zero = sector_is_zero_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		sector_is_zero = sector_is_zero_sse2;
+#endif
+}
+
+static int sparse_detect() {
+	map<UDF_Uint64,FileEntry>::iterator i;
+	UDF_Uint64 files = 0,zeros = 0;
+	unsigned char *buf = (unsigned char*)malloc(SPARSE_CHUNK);
+	if (!buf) {
+		cerr << "Cannot allocate memory for -sparse" << endl;
+		return 0;
+	}
+
+	sector_is_zero_init();
+	for (i=file_list.begin();i != file_list.end();i++) {
+		FileEntry *f = &i->second;
+		UDF_Uint64 sectors = file_data_sectors(f);
+		if (sectors <= SPARSE_MIN_SECTORS || f->fixed_start || f->existing_fe) continue;
+		if (f->link_id && f->link_id != f->id) continue;	/* has the first link's data */
+		if (bdmv_stream(f)) continue;				/* stays in one piece */
+
+		int fd = f->src_fd;
+		UDF_Uint64 base = f->src_offset;
+		if (fd < 0) {
+			fd = source_open(f->abspath.c_str());
+			base = 0;
+			if (fd < 0) continue;	/* it'll be reported when it is written */
+		}
+
+		/* (length, first sector) of each run. holes in the source file aren't read */
+		vector< pair<UDF_Uint64,UDF_Uint64> > runs;
+		SourceMap src(fd,base,f->file_size);
+		UDF_Uint64 sec = 0,run = 0,last = sectors - 1;
+		while (sec < last) {
+			UDF_Uint64 n = last - sec,k;
+			if (src.zero(sec << 11ULL,2048)) {
+				k = (src.run_end(sec << 11ULL) >> 11ULL) - sec;
+				if (k > n) k = n;
+				run += k;
+				sec += k;
+				continue;
+			}
+			k = ((src.run_end(sec << 11ULL) + 2047ULL) >> 11ULL) - sec;
+			if (n > k) n = k;
+			if (n > (SPARSE_CHUNK >> 11)) n = SPARSE_CHUNK >> 11;
+			if (pread64(fd,buf,n << 11ULL,base + (sec << 11ULL)) < (ssize_t)(n << 11ULL)) break;
+			for (k=0;k < n;k++) {
+				if (sector_is_zero(buf + (k << 11ULL))) {
+					run++;
+					continue;
+				}
+				if (run >= SPARSE_MIN_SECTORS) runs.push_back(pair<UDF_Uint64,UDF_Uint64>(run,sec+k-run));
+				run = 0;
+			}
+			sec += n;
+		}
+		if (run >= SPARSE_MIN_SECTORS) runs.push_back(pair<UDF_Uint64,UDF_Uint64>(run,sec-run));
+		if (fd != f->src_fd) close(fd);
+
+		size_t r;
+		for (r=0;r < runs.size();r++) {
+			f->holes[runs[r].second << 11ULL] = runs[r].first << 11ULL;
+			f->hole_sectors += runs[r].first;
+		}
+		if (f->hole_sectors) {
+			files++;
+			zeros += f->hole_sectors;
+		}
+	}
+
+	free(buf);
+	if (isatty(1))
+		cout << "* " << files << " sparse files, " << humanize(zeros << 11ULL) << " of zeros not stored" << endl;
+
+	return 1;
+}
+
+/* -dedupe: files with the same contents get one data extent between them, and cost no more than
+ * a File Entry each. Only files of the same size can be the same; of those, the ones whose first
+ * and last 64KB hash the same are hashed in full, and the same SHA-256 makes them the same. The
+ * hashing is spread over one worker process per CPU. */
+#define DEDUPE_SAMPLE		65536
+
+static map<UDF_Uint64,UDF_Uint64>		dedupe_extent;	/* first file's id -> start of the shared data */
+static multimap<UDF_Uint64,FileEntry*>		shared_extents;	/* start of a data extent -> the other files using it */
+static map<UDF_Uint64, list<FileEntry*> >	link_members;	/* hard links: first link's id -> the links in file_list */
+static map<UDF_Uint64,UDF_Uint32>		link_fe;	/* hard links: first link's id -> the File Entry they share */
+
+static int dedupe_digest(FileEntry *f,int full,UDF_Uint8 *digest) {
+	static unsigned char buf[1 << 20];
+	UDF_Uint64 ranges[2][2];
+	int fd = f->src_fd,nranges,r,ok = 1;
+	UDF_Uint64 base = f->src_offset;
+
+	if (fd < 0) {
+		if ((fd = source_open(f->abspath.c_str())) < 0)
+			return 0;
+		base = 0;
+	}
+
+	if (full || f->file_size <= DEDUPE_SAMPLE*2) {
+		ranges[0][0] = 0;
+		ranges[0][1] = f->file_size;
+		nranges = 1;
+	}
+	else {
+		ranges[0][0] = 0;
+		ranges[0][1] = DEDUPE_SAMPLE;
+		ranges[1][0] = f->file_size - DEDUPE_SAMPLE;
+		ranges[1][1] = f->file_size;
+		nranges = 2;
+	}
+
+	sha256_context ctx;
+	sha256_starts(&ctx);
+	for (r=0;r < nranges && ok;r++) {
+		UDF_Uint64 ofs = ranges[r][0];
+		while (ofs < ranges[r][1]) {
+			UDF_Uint64 want = ranges[r][1] - ofs;
+			if (want > sizeof(buf)) want = sizeof(buf);
+			int rd = pread64(fd,buf,(size_t)want,base + ofs);
+			if (rd <= 0) {
+				ok = 0;
+				break;
+			}
+			sha256_update(&ctx,buf,rd);
+			ofs += rd;
+		}
+	}
+	sha256_finish(&ctx,digest);
+
+	if (fd != f->src_fd) close(fd);
+	return ok;
+}
+
+class DedupeJob {
+	public:
+		vector<FileEntry*>	*files;
+		int			full;
+		UDF_Uint8		*shared;	/* per file an "ok" byte and the SHA-256 */
+};
+
+static int dedupe_job(void *ctx,size_t i) {
+	DedupeJob *j = (DedupeJob*)ctx;
+	j->shared[i*33] = dedupe_digest((*j->files)[i],j->full,j->shared + (i*33) + 1);
+	return 1;
+}
+
+/* digest every file, in parallel */
+static int dedupe_digests(vector<FileEntry*> &files,int full,vector<string> &digests) {
+	size_t n = files.size(),i;
+	if (n == 0) return 1;
+
+	UDF_Uint8 *shared = (UDF_Uint8*)shared_memory(n * 33);
+	if (!shared) return 0;
+
+	DedupeJob job;
+	job.files = &files;
+	job.full = full;
+	job.shared = shared;
+	if (!run_workers(n,dedupe_job,&job)) {
+		cerr << "ERROR: -dedupe: the files could not all be hashed" << endl;
+		munmap(shared,n * 33);
+		return 0;
+	}
+
+	/* unreadable files are never the same as anything */
+	digests.clear();
+	for (i=0;i < n;i++) {
+		if (shared[i*33]) digests.push_back(string((char*)shared + (i*33) + 1,32));
+		else {
+			char tmp[32];
+			sprintf(tmp,"unreadable %lu",(unsigned long)i);
+			digests.push_back(string(tmp));
+		}
+	}
+
+	munmap(shared,n * 33);
+	return 1;
+}
+
+static int dedupe() {
+	map<UDF_Uint64,FileEntry>::iterator i;
+	map<UDF_Uint64, vector<FileEntry*> > by_size;
+	map<UDF_Uint64, vector<FileEntry*> >::iterator si;
+	map<string, vector<FileEntry*> > groups;
+	map<string, vector<FileEntry*> >::iterator gi;
+	map<string,FileEntry*> owner;
+	vector<FileEntry*> candidates,whole,same;
+	vector<string> digests,keys;
+	UDF_Uint64 dups = 0,saved = 0;
+	size_t k;
+
+	/* only files with a data extent of their own to give up */
+	for (i=file_list.begin();i != file_list.end();i++) {
+		FileEntry *f = &i->second;
+		if (file_data_sectors(f) == 0 || f->fixed_start || f->existing_fe) continue;
+		if (f->link_id && f->link_id != f->id) continue;	/* has the first link's data */
+		by_size[f->file_size].push_back(f);
+	}
+
+	for (si=by_size.begin();si != by_size.end();si++)
+		if (si->second.size() > 1)
+			candidates.insert(candidates.end(),si->second.begin(),si->second.end());
+
+	/* the first and last 64KB. for small files that was all of it */
+	if (!dedupe_digests(candidates,0,digests)) return 0;
+	for (k=0;k < candidates.size();k++) {
+		char sz[32];
+		sprintf(sz,"%Lu:",candidates[k]->file_size);
+		groups[string(sz) + digests[k]].push_back(candidates[k]);
+	}
+	for (gi=groups.begin();gi != groups.end();gi++) {
+		if (gi->second.size() < 2) continue;
+		if (gi->second[0]->file_size > DEDUPE_SAMPLE*2) {
+			whole.insert(whole.end(),gi->second.begin(),gi->second.end());
+			continue;
+		}
+		for (k=0;k < gi->second.size();k++) {
+			same.push_back(gi->second[k]);
+			keys.push_back(gi->first);
+		}
+	}
+
+	/* then everything */
+	if (!dedupe_digests(whole,1,digests)) return 0;
+	for (k=0;k < whole.size();k++) {
+		char sz[32];
+		sprintf(sz,"%Lu:",whole[k]->file_size);
+		same.push_back(whole[k]);
+		keys.push_back(string(sz) + digests[k]);
+	}
+
+	/* the file that comes first keeps the data, the others point at it */
+	for (k=0;k < same.size();k++) {
+		map<string,FileEntry*>::iterator oi = owner.find(keys[k]);
+		if (oi == owner.end() || oi->second->id > same[k]->id) owner[keys[k]] = same[k];
+	}
+	for (k=0;k < same.size();k++) {
+		FileEntry *o = owner[keys[k]];
+		if (o == same[k]) continue;
+		same[k]->same_as = o->id;
+		dups++;
+		saved += file_data_sectors(same[k]);
+	}
+
+	if (isatty(1))
+		cout << "* " << dups << " duplicate files, " << humanize(saved << 11ULL) << " saved" << endl;
+
+	return 1;
+}
+
+/* -previous: incremental rebuild. The new ISO starts out as a copy (a reflink where possible) of the
+ * previous build, and every file whose size and modification time are the same as in the previous
+ * report keeps its sectors there. Those are reserved before anything else is laid out and are not
+ * written again; only the changed files and the UDF structures are. */
+class PreviousEntry {
+	public:
+		PreviousEntry() {
+			file_size = 0;
+			start = end = 0;
+		}
+	public:
+		UDF_Uint64	file_size;
+		string		mtime;
+		UDF_Uint64	start,end;		/* sectors, end is exclusive */
+};
+
+static map<string,PreviousEntry>	previous_entries;	/* by absolute path */
+
+static int load_previous_report(const char *path) {
+	char line[8192];
+	string cur;
+
+	FILE *fp = fopen(path,"r");
+	if (!fp) {
+		fprintf(stderr,"Cannot open previous report %s: %s\n",path,strerror(errno));
+		return 0;
+	}
+
+	while (fgets(line,sizeof(line),fp)) {
+		char *e = line + strlen(line);
+		while (e > line && (e[-1] == '\n' || e[-1] == '\r')) *--e = 0;
+
+		if (!strncmp(line,"\t" "Absolute path: ",16)) {
+			cur = line + 16;
+			previous_entries[cur] = PreviousEntry();
+		}
+		else if (cur == "") {
+			continue;
+		}
+		else if (!strncmp(line,"\t" "File size: ",12)) {
+			previous_entries[cur].file_size = strtoull(line + 12,NULL,10);
+		}
+		else if (!strncmp(line,"\t" "Modified: ",11)) {
+			previous_entries[cur].mtime = line + 11;
+		}
+		else if (!strncmp(line,"\t" "Sectors: ",10)) {
+			char *t = NULL;
+			PreviousEntry *p = &previous_entries[cur];
+			p->start = strtoull(line + 10,&t,10);
+			if (t && *t == '-') p->end = strtoull(t + 1,NULL,10) + 1ULL;
+		}
+		else if (line[0] != '\t') {
+			cur = "";
+		}
+	}
+
+	fclose(fp);
+	return 1;
+}
+
+/* start the new ISO as a copy of the previous one */
+static int clone_previous_image(const char *path,UDF_Uint64 &sectors) {
+	int fd = open64(path,O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr,"Cannot open previous image %s: %s\n",path,strerror(errno));
+		return 0;
+	}
+
+	UDF_Uint64 size = lseek64(fd,0,SEEK_END);
+	sectors = size >> 11ULL;
+
+	/* a resumed build already has it, and -print-size doesn't write anything */
+	if (resume_build || print_size) {
+		close(fd);
+		return 1;
+	}
+
+	int r = copy_range(fd,0,iso_fd,0,size);
+	if (r == 0) {
+		unsigned char buf[65536];
+		UDF_Uint64 ofs = 0;
+		iso_copy_range = 1;	/* that said nothing about copying from the sources */
+		while (ofs < size) {
+			int rd = pread64(fd,buf,sizeof(buf),ofs);
+			if (rd <= 0 || pwrite64(iso_fd,buf,rd,ofs) != rd) {
+				r = -1;
+				break;
+			}
+			ofs += rd;
+		}
+		if (ofs >= size) r = 1;
+	}
+
+	close(fd);
+	if (r < 0) {
+		fprintf(stderr,"Cannot copy previous image %s: %s\n",path,strerror(errno));
+		return 0;
+	}
+
+	return 1;
+}
+
+static int apply_previous_layout() {
+	UDF_Uint64 old_sectors = 0,kept = 0,kept_bytes = 0,changed = 0;
+	map<UDF_Uint64,FileEntry>::iterator i;
+
+	if (!load_previous_report(previous_report.c_str()))
+		return 0;
+	if (!clone_previous_image(previous_image.c_str(),old_sectors))
+		return 0;
+
+	for (i=file_list.begin();i != file_list.end();i++) {
+		FileEntry *f = &i->second;
+		if (f->characteristics & 2) continue;
+		if (f->file_size < FE_EMBED_MAX) continue;	/* embedded in the File Entry */
+		if (f->fixed_start) continue;
+		if (f->link_id && f->link_id != f->id) continue;	/* has the first link's data */
+
+		UDF_Uint64 sectors = file_data_sectors(f);
+		map<string,PreviousEntry>::iterator pi = previous_entries.find(f->abspath);
+		if (pi == previous_entries.end() || pi->second.file_size != f->file_size ||
+			pi->second.mtime == "" || pi->second.mtime != UDF_timestamp_str(f->file_mtime) ||
+			pi->second.start < 32 || (pi->second.start <= 256 && pi->second.end > 256) ||
+			(pi->second.end - pi->second.start) != sectors ||
+			pi->second.end > old_sectors) {
+			changed++;
+			continue;
+		}
+
+		/* two files can't claim overlapping sectors. the very same sectors are fine: the files
+		 * shared their data last time (-dedupe, or a hard link listed twice) and still do */
+		map<UDF_Uint64,OutputExtent>::iterator oi = output_extents.find(pi->second.start);
+		if (oi != output_extents.end() && oi->second.prewritten && oi->second.end == pi->second.end) {
+			f->fixed_start = pi->second.start;
+			kept++;
+			kept_bytes += f->file_size;
+			continue;
+		}
+		oi = output_extents.lower_bound(pi->second.start);
+		if (oi != output_extents.end() && oi->second.start < pi->second.end) {
+			changed++;
+			continue;
+		}
+		if (oi != output_extents.begin()) {
+			oi--;
+			if (oi->second.end > pi->second.start) {
+				changed++;
+				continue;
+			}
+		}
+
+		OutputExtent *e = NewOutputExtent(pi->second.start,sectors);
+		e->prewritten = 1;
+		f->fixed_start = pi->second.start;
+		kept++;
+		kept_bytes += f->file_size;
+	}
+
+	if (isatty(1))
+		cout << "* " << kept << " files (" << humanize(kept_bytes) << ") keep their place from the previous build, " <<
+			changed << " to write" << endl;
+
+	return 1;
+}
+
+/* Build journal, for resuming a build that died halfway. While the ISO is written, checkpoints are
+ * appended to <iso>.journal: how far the ISO is durably on disk, a digest of the last sector written
+ * and the state of the hash contexts. The journal starts with the build time (every timestamp in the
+ * UDF structures comes from it) and a digest of the layout. -resume lays the ISO out again with the
+ * same build time, and if the layout digest matches and the partial ISO ends the way the last
+ * checkpoint says, carries on from there. The journal is removed when the ISO is complete. */
+typedef struct {
+	char		magic[8];		/* "MKUDFJ1" */
+	UDF_Uint64	build_time;
+	UDF_Uint8	layout[20];		/* SHA-1 of the layout, see layout_digest() */
+	UDF_Uint32	crc;
+} JournalHeader;
+
+typedef struct {
+	char		magic[4];		/* "FILE": per-file digests, for files finished before the next checkpoint */
+	UDF_Uint64	id;
+	UDF_Uint64	hash_length;
+	UDF_Uint8	md5[16];
+	UDF_Uint8	sha1[20];
+	UDF_Uint8	sha256[32];
+	UDF_Uint32	crc;
+} JournalFile;
+
+typedef struct {
+	char		magic[4];		/* "CKPT" */
+	UDF_Uint64	sector;			/* everything before this sector is on disk */
+	UDF_Uint64	file_bytes;		/* how far into the file whose extent holds 'sector' */
+	UDF_Uint64	hash_length;
+	UDF_Uint64	iso_sectors;
+	UDF_Uint8	last_sector[20];	/* SHA-1 of sector-1 */
+	sha256_context	iso_sha256;
+	sha1_context	iso_sha1;
+	md5_context	iso_md5;
+	sha256_context	file_sha256;
+	sha1_context	file_sha1;
+	md5_context	file_md5;
+	UDF_Uint32	crc;
+} JournalCheckpoint;
+
+/* CRC of everything up to the crc field */
+#define JOURNAL_CRC(r) osta_cksum((unsigned char*)&(r),(int)(((unsigned char*)&((r).crc)) - ((unsigned char*)&(r))))
+
+static UDF_Uint64		checkpoint_interval = 256ULL << 20ULL;	/* bytes of ISO between checkpoints, 0 = no journal */
+static string			journal_path;
+static FILE			*journal_fp = NULL;
+static UDF_Uint64		journal_next = 0;	/* sector at which the next checkpoint is due */
+static JournalHeader		journal_header;
+static JournalCheckpoint	journal_resume;		/* the last complete checkpoint, if journal_have_resume */
+static int			journal_have_resume = 0;
+static long			journal_valid_end = 0;	/* anything after this is a torn record */
+static map<UDF_Uint64,JournalFile> journal_files;
+
+/* read the journal left by the interrupted build */
+static int journal_load() {
+	list<JournalFile> pending;
+	char magic[4];
+
+	FILE *fp = fopen(journal_path.c_str(),"rb");
+	if (!fp) {
+		fprintf(stderr,"Cannot resume, no journal %s: %s\n",journal_path.c_str(),strerror(errno));
+		return 0;
+	}
+	if (fread(&journal_header,sizeof(journal_header),1,fp) != 1 || memcmp(journal_header.magic,"MKUDFJ1",8) ||
+		journal_header.crc != JOURNAL_CRC(journal_header)) {
+		fprintf(stderr,"Cannot resume, %s is not a mkudfiso journal\n",journal_path.c_str());
+		fclose(fp);
+		return 0;
+	}
+	journal_valid_end = ftell(fp);
+
+	while (fread(magic,4,1,fp) == 1) {
+		fseek(fp,-4,SEEK_CUR);
+		if (!memcmp(magic,"FILE",4)) {
+			JournalFile r;
+			if (fread(&r,sizeof(r),1,fp) != 1 || r.crc != JOURNAL_CRC(r)) break;
+			pending.push_back(r);
+		}
+		else if (!memcmp(magic,"CKPT",4)) {
+			JournalCheckpoint r;
+			if (fread(&r,sizeof(r),1,fp) != 1 || r.crc != JOURNAL_CRC(r)) break;
+
+			list<JournalFile>::iterator pi;
+			for (pi=pending.begin();pi != pending.end();pi++) journal_files[pi->id] = *pi;
+			pending.clear();
+
+			journal_resume = r;
+			journal_have_resume = 1;
+			journal_valid_end = ftell(fp);
+		}
+		else {
+			break;
+		}
+	}
+
+	fclose(fp);
+	build_time = (time_t)journal_header.build_time;
+	return 1;
+}
+
+/* everything that decides what ends up where in the ISO */
+static void layout_digest(UDF_Uint8 *digest) {
+	map<UDF_Uint64,OutputExtent>::iterator i;
+	sha1_context ctx;
+
+	sha1_starts(&ctx);
+	for (i=output_extents.begin();i != output_extents.end();i++) {
+		OutputExtent *e = &i->second;
+		UDF_Uint64 r[3] = { e->start, e->end, (UDF_Uint64)e->prewritten };
+		sha1_update(&ctx,(unsigned char*)r,sizeof(r));
+		if (e->content && e->content_length >= 176 && e->content_length <= 2048 &&
+			(LGETWORD(e->content) == UDFtag_FileEntry || LGETWORD(e->content) == UDFtag_ExtendedFileEntry)) {
+			/* a File Entry less its access time, and the tag checksum and CRC that cover it: the
+			 * reads of the interrupted build itself may have moved the atimes of the sources */
+			unsigned char fe[2048];
+			memcpy(fe,e->content,e->content_length);
+			fe[4] = 0;
+			memset(fe+8,0,2);
+			memset(fe + (LGETWORD(fe) == UDFtag_ExtendedFileEntry ? 80 : 72),0,12);
+			sha1_update(&ctx,fe,e->content_length);
+		}
+		else if (e->content)
+			sha1_update(&ctx,e->content,e->content_length);
+		if (e->file) {
+			string f = e->file->abspath + string("\n") + UDF_timestamp_str(e->file->file_mtime);
+			sha1_update(&ctx,(unsigned char*)f.data(),f.length());
+			sha1_update(&ctx,(unsigned char*)&e->file->file_size,sizeof(e->file->file_size));
+		}
+	}
+	sha1_finish(&ctx,digest);
+}
+
+/* SHA-1 of an ISO sector as it is on disk */
+static void sector_digest(UDF_Uint64 sector,UDF_Uint8 *digest) {
+	unsigned char buf[2048];
+	sha1_context ctx;
+
+	if (pread64(iso_fd,buf,2048,sector << 11ULL) < 2048)
+		memset(buf,0xFF,2048);
+	sha1_starts(&ctx);
+	sha1_update(&ctx,buf,2048);
+	sha1_finish(&ctx,digest);
+}
+
+/* decide where writing starts: returns the first sector to write, or -1 to give up */
+static signed long long journal_open(UDF_Uint64 highest_sector) {
+	UDF_Uint8 layout[20];
+
+	layout_digest(layout);
+	if (resume_build) {
+		if (memcmp(layout,journal_header.layout,20)) {
+			fprintf(stderr,"Cannot resume: the source files or options are not the same as in the interrupted build\n");
+			return -1;
+		}
+
+		if (journal_have_resume) {
+			UDF_Uint8 last[20];
+			struct stat64 st;
+			UDF_Uint64 n = journal_resume.sector;
+
+			sector_digest(n - 1ULL,last);
+			if (n > highest_sector || fstat64(iso_fd,&st) < 0 || (UDF_Uint64)st.st_size < (n << 11ULL) ||
+				memcmp(last,journal_resume.last_sector,20)) {
+				fprintf(stderr,"Cannot resume: the partial ISO does not match the journal\n");
+				return -1;
+			}
+
+			map<UDF_Uint64,JournalFile>::iterator ji;
+			for (ji=journal_files.begin();ji != journal_files.end();ji++) {
+				map<UDF_Uint64,FileEntry>::iterator fi = file_list.find(ji->first);
+				if (fi == file_list.end()) continue;
+				fi->second.hash_length = ji->second.hash_length;
+				memcpy(fi->second.md5,ji->second.md5,16);
+				memcpy(fi->second.sha1,ji->second.sha1,20);
+				memcpy(fi->second.sha256,ji->second.sha256,32);
+			}
+		}
+
+		if ((journal_fp = fopen(journal_path.c_str(),"r+b")) == NULL ||
+			ftruncate(fileno(journal_fp),journal_valid_end) < 0) {
+			fprintf(stderr,"Cannot reopen journal %s: %s\n",journal_path.c_str(),strerror(errno));
+			return -1;
+		}
+		fseek(journal_fp,0,SEEK_END);
+	}
+	else {
+		if ((journal_fp = fopen(journal_path.c_str(),"wb")) == NULL) {
+			fprintf(stderr,"Cannot create journal %s: %s\n",journal_path.c_str(),strerror(errno));
+			return -1;
+		}
+
+		memset(&journal_header,0,sizeof(journal_header));
+		memcpy(journal_header.magic,"MKUDFJ1",8);
+		journal_header.build_time = build_time;
+		memcpy(journal_header.layout,layout,20);
+		journal_header.crc = JOURNAL_CRC(journal_header);
+		fwrite(&journal_header,sizeof(journal_header),1,journal_fp);
+		fflush(journal_fp);
+		fdatasync(fileno(journal_fp));
+	}
+
+	UDF_Uint64 first = (resume_build && journal_have_resume) ? journal_resume.sector : 0;
+	journal_next = first + (checkpoint_interval >> 11ULL);
+	return first;
+}
+
+static void journal_file_done(FileEntry *f) {
+	JournalFile r;
+
+	memset(&r,0,sizeof(r));
+	memcpy(r.magic,"FILE",4);
+	r.id = f->id;
+	r.hash_length = f->hash_length;
+	memcpy(r.md5,f->md5,16);
+	memcpy(r.sha1,f->sha1,20);
+	memcpy(r.sha256,f->sha256,32);
+	r.crc = JOURNAL_CRC(r);
+	fwrite(&r,sizeof(r),1,journal_fp);
+}
+
+/* sectors before n are written. make them durable, then say so in the journal */
+static void journal_checkpoint(UDF_Uint64 n,UDF_Uint64 iso_sectors,sha256_context *sha256_ctx,sha1_context *sha1_ctx,
+	md5_context *md5_ctx,FileEntry *f,UDF_Uint64 file_bytes,UDF_Uint64 hash_length) {
+	JournalCheckpoint r;
+
+	if (fdatasync(iso_fd) < 0) {
+		fprintf(stderr,"write error: cannot sync iso image. %s\n",strerror(errno));
+		exit(1);
+	}
+
+	memset(&r,0,sizeof(r));
+	memcpy(r.magic,"CKPT",4);
+	r.sector = n;
+	r.file_bytes = file_bytes;
+	r.hash_length = hash_length;
+	r.iso_sectors = iso_sectors;
+	sector_digest(n - 1ULL,r.last_sector);
+	r.iso_sha256 = *sha256_ctx;
+	r.iso_sha1 = *sha1_ctx;
+	r.iso_md5 = *md5_ctx;
+	if (f) {
+		r.file_sha256 = f->sha256_ctx;
+		r.file_sha1 = f->sha1_ctx;
+		r.file_md5 = f->md5_ctx;
+	}
+	r.crc = JOURNAL_CRC(r);
+	fwrite(&r,sizeof(r),1,journal_fp);
+	fflush(journal_fp);
+	fdatasync(fileno(journal_fp));
+
+	journal_next = n + (checkpoint_interval >> 11ULL);
+}
+
+/* -patch: rewrite a few descriptors of an existing image in place. Only the sectors of the
+ * Primary Volume Descriptor, Implementation Use Volume Descriptor, Logical Volume Descriptor
+ * (main and reserve sequence), File Set Descriptor and Logical Volume Integrity Descriptor are
+ * read and written back, with their checksums and CRCs recomputed. A new report is appended to
+ * the end of the image, like the report of a new ISO. */
+static int patch_descriptor(int fd,UDF_Uint64 sector,unsigned char *buf) {
+	UDF_tag *tag = (UDF_tag*)buf;
+	SET_UDF_tag_checksum(*tag,tag->DescriptorCRCLength);
+	if (pwrite64(fd,buf,2048,sector << 11ULL) != 2048) {
+		fprintf(stderr,"Cannot write sector %Lu: %s\n",sector,strerror(errno));
+		return 0;
+	}
+	return 1;
+}
+
+static int patch_volume_descriptors(UDFImage &img,int fd,UDF_Uint32 start,UDF_Uint32 count,UDF_Uint64 &lvid,int &patched) {
+	unsigned char buf[2048];
+	UDF_Uint32 i;
+
+	for (i=0;i < count;i++) {
+		UDF_Uint64 sector = start + i;
+		if (!img.read_sector(sector,buf)) break;
+		UDF_Uint16 id = ((UDF_tag*)buf)->TagIdentifier;
+		if (id == UDFtag_TerminatingDescriptor || !img.read_descriptor(sector,sector,id,buf)) break;
+
+		if (id == UDFtag_PrimaryVolumeDescriptor) {
+			UDF_tag_primary_volume_descriptor *pvd = (UDF_tag_primary_volume_descriptor*)buf;
+			if (volume_label != "")
+				UDF_dstring_strncpy(pvd->VolumeIdentifier,sizeof(pvd->VolumeIdentifier),volume_label.c_str());
+			if (patch_time)
+				UDF_timestamp_set(pvd->RecordingDateAndTime,patch_time);
+		}
+		else if (id == UDFtag_ImplementationUseVolumeDescriptor) {
+			/* only the "*UDF LV Info" one has the label */
+			if (memcmp(buf+21,"*UDF LV Info",12) || volume_label == "") continue;
+			UDF_dstring_strncpy((buf+116),128,volume_label.c_str());
+		}
+		else if (id == UDFtag_LogicalVolumeDescriptor) {
+			UDF_tag_logical_volume_descriptor *lv = (UDF_tag_logical_volume_descriptor*)buf;
+			if (volume_label != "")
+				UDF_dstring_strncpy(lv->LogicalVolumeIdentifier,sizeof(lv->LogicalVolumeIdentifier),volume_label.c_str());
+			lvid = lv->IntegritySequenceExtent.location;
+		}
+		else {
+			continue;
+		}
+
+		if (!patch_descriptor(fd,sector,buf)) return 0;
+		patched++;
+	}
+
+	return 1;
+}
+
+static int patch_image(const char *path) {
+	unsigned char buf[2048];
+	UDFImage img;
+	UDF_Uint64 lvid = 0;
+	int patched = 0;
+
+	if (!img.open(path))
+		return 0;
+
+	int fd = open64(path,O_RDWR);
+	if (fd < 0) {
+		fprintf(stderr,"Cannot open %s for writing: %s\n",path,strerror(errno));
+		return 0;
+	}
+
+	/* main and reserve Volume Descriptor Sequences */
+	if (!patch_volume_descriptors(img,fd,img.vds_start,img.vds_sectors,lvid,patched))
+		return 0;
+	if (img.read_descriptor(256,256,UDFtag_AnchorVolumeDescriptor,buf)) {
+		UDF_tag_anchor_volume_descriptor *anchor = (UDF_tag_anchor_volume_descriptor*)buf;
+		UDF_Uint64 dummy;
+		if (anchor->ReserveVolumeDescriptorSequenceExtent.location != 0 &&
+			!patch_volume_descriptors(img,fd,anchor->ReserveVolumeDescriptorSequenceExtent.location,
+				anchor->ReserveVolumeDescriptorSequenceExtent.length >> 11,dummy,patched))
+			return 0;
+	}
+
+	/* File Set Descriptor */
+	UDF_Uint64 fsd_sector = img.block_sector(img.fsd_lbn,img.fsd_ref);
+	if (fsd_sector && img.read_descriptor(fsd_sector,img.fsd_lbn,UDFtag_FileSetDescriptor,buf)) {
+		UDF_tag_file_set_descriptor *fset = (UDF_tag_file_set_descriptor*)buf;
+		if (volume_label != "") {
+			UDF_dstring_strncpy(fset->LogicalVolumeIdentifier,sizeof(fset->LogicalVolumeIdentifier),volume_label.c_str());
+			UDF_dstring_strncpy(fset->FileSetIdentifier,sizeof(fset->FileSetIdentifier),volume_label.c_str());
+		}
+		if (patch_time)
+			UDF_timestamp_set(fset->RecordingDateAndTime,patch_time);
+		if (!patch_descriptor(fd,fsd_sector,buf)) return 0;
+		patched++;
+
+		/* and the metadata mirror's copy */
+		UDF_Uint64 mirror = img.mirror_sector(img.fsd_lbn,img.fsd_ref);
+		if (mirror && mirror != fsd_sector) {
+			if (!patch_descriptor(fd,mirror,buf)) return 0;
+			patched++;
+		}
+	}
+
+	/* Logical Volume Integrity Descriptor. older mkudfiso images have it right after the
+	 * Volume Descriptor Sequence, not where the Logical Volume Descriptor says */
+	if (lvid == 0 || !img.read_descriptor(lvid,lvid,UDFtag_LogicalVolumeIntegrityDescriptor,buf)) {
+		UDF_Uint32 i;
+		lvid = 0;
+		for (i=0;i < 16 && lvid == 0;i++)
+			if (img.read_descriptor(img.vds_start+i,img.vds_start+i,UDFtag_LogicalVolumeIntegrityDescriptor,buf))
+				lvid = img.vds_start+i;
+	}
+	if (lvid != 0) {
+		UDF_tag_logical_volume_integrity_descriptor *lv = (UDF_tag_logical_volume_integrity_descriptor*)buf;
+		if (patch_time)
+			UDF_timestamp_set(lv->RecordingDateAndTime,patch_time);
+		if (!patch_descriptor(fd,lvid,buf)) return 0;
+		patched++;
+	}
+	else {
+		fprintf(stderr,"%s: no Logical Volume Integrity Descriptor found\n",path);
+	}
+
+	/* a new report goes after everything else, like the report of a new ISO */
+	if (report_file != "") {
+		int rfd = open64(report_file.c_str(),O_RDONLY);
+		if (rfd < 0) {
+			fprintf(stderr,"Cannot open report %s: %s\n",report_file.c_str(),strerror(errno));
+			return 0;
+		}
+
+		UDF_Uint64 starting_sector = img.sectors,n = img.sectors;
+		UDF_Uint64 report_sz = 0;
+		int rd;
+		while ((rd=read(rfd,buf,2048)) > 0) {
+			if (rd < 2048) memset(buf+rd,0,2048-rd);
+			if (pwrite64(fd,buf,2048,n << 11ULL) != 2048) {
+				fprintf(stderr,"Cannot append report: %s\n",strerror(errno));
+				return 0;
+			}
+			report_sz += rd;
+			n++;
+		}
+		close(rfd);
+
+		UDF_tag_implementation_use_volume_descriptor ftag;
+		memset(&ftag,0,sizeof(ftag));
+		SET_UDF_tag(ftag.DescriptorTag,UDFtag_ImplementationUseVolumeDescriptor,n,DESCRIPTOR_VERSION);
+		UPDATE_UDF_tag(ftag.DescriptorTag);
+		LSETDWORD(&ftag.VolumeDescriptorSequenceNumber,1);
+		SET_UDF_regid(ftag.ImplementationIdentifier,1,"*mkudfiso","Report");
+		LSETDWORD((((unsigned char*)(&ftag))+52),starting_sector);
+		LSETDWORD((((unsigned char*)(&ftag))+56),report_sz);
+		SET_UDF_tag_checksum(ftag.DescriptorTag,60-16);
+		memset(buf,0,2048);
+		memcpy(buf,&ftag,60);
+		if (pwrite64(fd,buf,2048,n << 11ULL) != 2048) {
+			fprintf(stderr,"Cannot append report: %s\n",strerror(errno));
+			return 0;
+		}
+		cerr << "Report appended at sector " << starting_sector << endl;
+	}
+
+	if (fdatasync(fd) < 0) {
+		fprintf(stderr,"Cannot sync %s: %s\n",path,strerror(errno));
+		return 0;
+	}
+	close(fd);
+
+	cerr << "Patched " << patched << " descriptors" << endl;
+	return 1;
+}
+
+static int parse_args(int argc,char **argv) {
+	int i,nonsw=0;
+	char forget=0;
+
+	for (i=1;i < argc;) {
+		char *a = argv[i++];
+
+		if (*a == '-' && !forget) {
+			char *sw = a+1;
+			if (*sw == '-') sw++;
+
+			/* -- means treat further arguments starting with '-' as file names, etc. */
+			if (*sw == 0) {
+				forget = 1;
+			}
+			else if (!strcmp(sw,"limit")) {
+				char *e = argv[i++];
+				if (!e) continue;
+				iso_size_limit = metric_atoi(e);
+			}
+			else if (!strcmp(sw,"span")) {
+				char *e = argv[i++];
+				if (!e) continue;
+				span_capacity = metric_atoi(e);
+			}
+			else if (!strcmp(sw,"print-size")) {
+				print_size = 1;
+			}
+			else if (!strcmp(sw,"o")) {
+				char *e = argv[i++];
+				if (!e) continue;
+				if (*e == '/')	iso_file = e;
+				else		iso_file = invoked_root + string("/") + string(e);
+			}
+			else if (!strcmp(sw,"report")) {
+				char *e = argv[i++];
+				if (!e) continue;
+				if (*e == '/')	report_file = e;
+				else		report_file = invoked_root + string("/") + string(e);
+			}
+			else if (!strcmp(sw,"hashes")) {
+				char *e = argv[i++];
+				if (!e) continue;
+				if (*e == '/')	hashtable_file = e;
+				else		hashtable_file = invoked_root + string("/") + string(e);
+			}
+			else if (!strcmp(sw,"gap")) {
+				char *e = argv[i++];
+				if (!e) continue;
+				if (*e == '/')	gap_file = e;
+				else		gap_file = invoked_root + string("/") + string(e);
+			}
+			else if (!strcmp(sw,"dedupe")) {
+				dedupe_files = 1;
+			}
+			else if (!strcmp(sw,"cluster-metadata")) {
+				cluster_metadata = 1;
+			}
+			else if (!strcmp(sw,"align")) {
+				char *e = argv[i++];
+				if (!e) continue;
+				if (!strcmp(e,"dvd"))		align_sectors = 16;	/* 32KB ECC blocks */
+				else if (!strcmp(e,"bd"))	align_sectors = 32;	/* 64KB clusters */
+				else {
+					UDF_Uint64 b = metric_atoi(e);
+					if (b < 2048 || (b & 2047)) {
+						fprintf(stderr,"-align %s: dvd, bd or a multiple of 2048 bytes\n",e);
+						return 0;
+					}
+					align_sectors = b >> 11ULL;
+				}
+			}
+			else if (!strcmp(sw,"align-dirs")) {
+				align_dirs = 1;
+			}
+			else if (!strcmp(sw,"bdmv")) {
+				bdmv_mode = 1;
+			}
+			else if (!strcmp(sw,"access-trace")) {
+				char *e = argv[i++];
+				if (!e) continue;
+				if (*e == '/')	access_trace = e;
+				else		access_trace = invoked_root + string("/") + string(e);
+			}
+			else if (!strcmp(sw,"cav")) {
+				trace_cav = 1;
+			}
+			else if (!strcmp(sw,"source-order")) {
+				source_order = 1;
+			}
+			else if (!strcmp(sw,"layer-break")) {
+				char *e = argv[i++];
+				if (!e) continue;
+				if (!strcmp(e,"dvd9"))		layer_break = 2086912;	/* layer 0 of DVD+R DL */
+				else if (!strcmp(e,"bd50"))	layer_break = 12219392;	/* layer 0 of BD-R DL */
+				else {
+					char *t = NULL;
+					layer_break = strtoull(e,&t,10);
+					if (!t || *t || layer_break <= 256) {
+						fprintf(stderr,"-layer-break %s: dvd9, bd50 or a sector past the anchor (256)\n",e);
+						return 0;
+					}
+				}
+			}
+			else if (!strcmp(sw,"udf-rev")) {
+				char *e = argv[i++];
+				if (!e) continue;
+				if (!strcmp(e,"1.02"))		udf_revision = 0x0102;
+				else if (!strcmp(e,"2.50"))	udf_revision = 0x0250;
+				else {
+					fprintf(stderr,"-udf-rev %s: only 1.02 and 2.50 are supported\n",e);
+					return 0;
+				}
+			}
+			else if (!strcmp(sw,"sparse")) {
+				auto_sparse_detect = 1;
+			}
+			else if (!strcmp(sw,"exclude") || !strcmp(sw,"include") ||
+				!strcmp(sw,"exclude-regex") || !strcmp(sw,"include-regex")) {
+				char *e = argv[i++];
+				if (!e) continue;
+				scan_rule_add(e,(sw[0] == 'i') ? 1 : 0,strstr(sw,"-regex") != NULL);
+			}
+			else if (!strcmp(sw,"tar")) {
+				char *e = argv[i++];
+				if (!e) continue;
+				if (*e == '/' || !strcmp(e,"-"))	tar_source = e;
+				else					tar_source = invoked_root + string("/") + string(e);
+			}
+			else if (!strcmp(sw,"previous") || !strcmp(sw,"previous-report")) {
+				char *e = argv[i++];
+				if (!e) continue;
+				string &t = strcmp(sw,"previous") ? previous_report : previous_image;
+				if (*e == '/')	t = e;
+				else		t = invoked_root + string("/") + string(e);
+			}
+			else if (!strcmp(sw,"append")) {
+				char *e = argv[i++];
+				if (!e) continue;
+				append_session = 1;
+				if (*e == '/')	iso_file = e;
+				else		iso_file = invoked_root + string("/") + string(e);
+			}
+			else if (!strcmp(sw,"patch")) {
+				char *e = argv[i++];
+				if (!e) continue;
+				if (*e == '/')	patch_target = e;
+				else		patch_target = invoked_root + string("/") + string(e);
+			}
+			else if (!strcmp(sw,"timestamp")) {
+				char *e = argv[i++];
+				if (!e) continue;
+				patch_time = strcmp(e,"now") ? (time_t)strtoll(e,NULL,0) : time(NULL);
+			}
+			else if (!strcmp(sw,"resume")) {
+				resume_build = 1;
+			}
+			else if (!strcmp(sw,"checkpoint")) {
+				char *e = argv[i++];
+				if (!e) continue;
+				checkpoint_interval = metric_atoi(e);
+			}
+			else if (!strcmp(sw,"from-image")) {
+				char *e = argv[i++];
+				if (!e) continue;
+				if (*e == '/')	source_image = e;
+				else		source_image = invoked_root + string("/") + string(e);
+			}
+			else if (!strcmp(sw,"force-iso")) {
+				iso_overwrite = 1;
 			}
 			else if (!strcmp(sw,"v") || !strcmp(sw,"volume")) {
 				char *e = argv[i++];
@@ -499,51 +3507,784 @@ static int parse_args(int argc,char **argv) {
 				fprintf(stderr,"For personal noncommercial use ONLY\n");
 				fprintf(stderr,"\n");
 				fprintf(stderr,"mkudfiso [options] <directory to compile into ISO>\n");
+				fprintf(stderr,"mkudfiso [options] -tar <file, or - for stdin>\n");
+				fprintf(stderr,"mkudfiso [options] -from-image <udf image> [directory to lay over it]\n");
+				fprintf(stderr,"mkudfiso -patch <iso> [-v <label>] [-timestamp <time>] [-report <file>]\n");
 				fprintf(stderr,"  -limit <size>    Error out if resulting ISO will exceed this limit\n");
 				fprintf(stderr,"       size can be a number in bytes followed by KB,MB,GB,TB\n");
 				fprintf(stderr,"            CD-ROM     640MB\n");
 				fprintf(stderr,"            DVD-R      4482MB\n");
 				fprintf(stderr,"            DVD-R+DL   8105MB\n");
 				fprintf(stderr,"            BD-ROM     2336GB\n");
+				fprintf(stderr,"  -print-size      Work out the exact size of the ISO, print it and stop\n");
+				fprintf(stderr,"  -span <size>     Spread the files over as many volumes of <size> as needed,\n");
+				fprintf(stderr,"                   written to <iso>_1, <iso>_2, ... (-o is required)\n");
 				fprintf(stderr,"  -report <file>   Generate a report about the ISO. <file> will be a text file\n");
 				fprintf(stderr,"                   If space is available, the report is added to the ISO file\n");
 				fprintf(stderr,"  -force-iso       Overwrite ISO file if it already exists\n");
 				fprintf(stderr,"  -sparse          Detect long runs of zero sectors and make the file sparse\n");
+				fprintf(stderr,"  -dedupe          Store files with the same contents only once\n");
+				fprintf(stderr,"  -cluster-metadata  All directories and File Entries first, then the data\n");
+				fprintf(stderr,"  -align <dvd|bd|size>\n");
+				fprintf(stderr,"                   Start files of at least one ECC block (dvd=32KB, bd=64KB) on\n");
+				fprintf(stderr,"                   a block boundary. -align-dirs: directories too\n");
+				fprintf(stderr,"  -bdmv            Blu-ray layout: .m2ts streams in one piece on 6144 byte aligned\n");
+				fprintf(stderr,"                   units, the navigation files together near the start\n");
+				fprintf(stderr,"  -access-trace <file>\n");
+				fprintf(stderr,"                   Lay out the files listed (\"<path> [count]\" per line) first,\n");
+				fprintf(stderr,"                   in one run in that order. -cav: at the end, hottest last\n");
+				fprintf(stderr,"  -source-order    Copy the files in the order they lie on the source disk(s)\n");
+				fprintf(stderr,"  -layer-break <dvd9|bd50|sector>\n");
+				fprintf(stderr,"                   Dual layer media: no file is placed across the layer break\n");
+				fprintf(stderr,"  -udf-rev <1.02|2.50>\n");
+				fprintf(stderr,"                   UDF revision. 2.50 keeps the metadata in a metadata partition\n");
+				fprintf(stderr,"                   with a mirror at the end of the disc (default 1.02)\n");
+				fprintf(stderr,"  -exclude <glob>  Leave out files and directories matching <glob>\n");
+				fprintf(stderr,"  -include <glob>  Keep entries matching <glob> even if a later -exclude matches\n");
+				fprintf(stderr,"       a glob without '/' matches names, with '/' the path below the root.\n");
+				fprintf(stderr,"       a trailing '/' matches directories only. first matching rule wins.\n");
+				fprintf(stderr,"  -exclude-regex <re>, -include-regex <re>\n");
+				fprintf(stderr,"                   Same, using an extended regex against the relative path\n");
                                 fprintf(stderr,"  -o filename      Output filename\n") ;
+				fprintf(stderr,"  -tar <file>      Take the contents from a tar/pax stream (- = stdin)\n");
+				fprintf(stderr,"  -from-image <iso>\n");
+				fprintf(stderr,"                   Take the contents from an existing UDF image. Files in the\n");
+				fprintf(stderr,"                   directory, if given, replace or add to those in the image\n");
+				fprintf(stderr,"  -previous <iso> -previous-report <file>\n");
+				fprintf(stderr,"                   Incremental rebuild: start from a copy of the previous ISO,\n");
+				fprintf(stderr,"                   unchanged files keep their sectors and are not rewritten\n");
+				fprintf(stderr,"  -patch <iso>     Change the label (-v), recording time (-timestamp <seconds|now>)\n");
+				fprintf(stderr,"                   or embedded report (-report) of an existing ISO in place\n");
+				fprintf(stderr,"  -append <iso>    Add the directory's new and changed files to <iso> as a new\n");
+				fprintf(stderr,"                   session, without rewriting what is already in it\n");
+				fprintf(stderr,"  -checkpoint <size>\n");
+				fprintf(stderr,"                   Record a checkpoint in <iso>.journal every <size> (256MB; 0=off)\n");
+				fprintf(stderr,"  -resume          Continue an interrupted build from its last checkpoint\n");
 				fprintf(stderr,"  -v <label>       Set volume label\n");
 				return 0;
 			}
 			else {
-				fprintf(stderr,"Unknown switch %s\n",sw);
-				return 0;
-			}
-		}
-		else {
-			switch (nonsw++) {
-				case 0:
-					content_root = a;
-					break;
-				default:
-					fprintf(stderr,"Ignored: %s\n",a);
+				fprintf(stderr,"Unknown switch %s\n",sw);
+				return 0;
+			}
+		}
+		else {
+			switch (nonsw++) {
+				case 0:
+					content_root = a;
+					break;
+				default:
+					fprintf(stderr,"Ignored: %s\n",a);
+			}
+		}
+	}
+
+	if (patch_target != "") {
+		if (volume_label == "" && patch_time == 0 && report_file == "") {
+			fprintf(stderr,"-patch needs something to change: -v, -timestamp or -report\n");
+			return 0;
+		}
+		return 1;
+	}
+
+	if (content_root.length() < 1 && tar_source.length() < 1 && source_image.length() < 1) {
+		fprintf(stderr,"You must specify a directory who's contents are to be made into a UDF filesystem\n");
+		return 0;
+	}
+
+	if ((previous_image == "") != (previous_report == "")) {
+		fprintf(stderr,"-previous and -previous-report go together\n");
+		return 0;
+	}
+	if (append_session && (content_root == "" || tar_source != "" || source_image != "" || previous_image != "")) {
+		fprintf(stderr,"-append adds the files of a directory, and can't be combined with -tar, -from-image or -previous\n");
+		return 0;
+	}
+	if (align_dirs && !align_sectors) {
+		fprintf(stderr,"-align-dirs needs -align to say what to align them to\n");
+		return 0;
+	}
+	if (trace_cav && access_trace == "") {
+		fprintf(stderr,"-cav moves the files of an access trace, it needs -access-trace\n");
+		return 0;
+	}
+	if (append_session && udf_revision >= 0x0250) {
+		fprintf(stderr,"-append can't be combined with -udf-rev 2.50, a session can't add to the metadata partition\n");
+		return 0;
+	}
+	if (span_capacity) {
+		if (iso_file == "" && !print_size) {
+			fprintf(stderr,"-span needs the ISO file name (-o) to name the volumes after\n");
+			return 0;
+		}
+		if (append_session || previous_image != "" || resume_build) {
+			fprintf(stderr,"-span can't be combined with -append, -previous or -resume\n");
+			return 0;
+		}
+		/* -limit makes the volumes smaller, if anything */
+		if (iso_size_limit && iso_size_limit < span_capacity) span_capacity = iso_size_limit;
+		iso_size_limit = 0;
+	}
+	if (resume_build && print_size) {
+		fprintf(stderr,"-print-size can't be combined with -resume\n");
+		return 0;
+	}
+	if (resume_build && (iso_file == "" || checkpoint_interval == 0)) {
+		fprintf(stderr,"-resume needs the ISO file (-o) and its journal\n");
+		return 0;
+	}
+	if (previous_image != "" && iso_file == "") {
+		fprintf(stderr,"-previous needs the ISO to be written to a file (-o)\n");
+		return 0;
+	}
+	if (source_order && iso_file == "" && !print_size) {
+		fprintf(stderr,"-source-order needs the ISO to be written to a file (-o)\n");
+		return 0;
+	}
+
+	if (!scan_rules_compile())
+		return 0;
+
+	return 1;
+}
+
+/* read the start of a file, for contents that are embedded in the File Entry */
+static int read_file_head(FileEntry *oex,unsigned char *buf,int len) {
+	int r = -1;
+
+	if (oex->src_fd >= 0) {
+		r = pread64(oex->src_fd,buf,len,oex->src_offset);
+	}
+	else if (extra_large_chdir(oex->path.c_str()) < 0) {
+		cerr << "Cannot enter " << oex->path << endl;
+		return -1;
+	}
+	else {
+		int fd = source_open(oex->name.c_str());
+		if (fd < 0) {
+			cerr << "Cannot open " << oex->abspath << endl;
+			return -1;
+		}
+		r = read(fd,buf,len);
+		close(fd);
+	}
+
+	if (r < len)
+		cerr << "WARNING: Read less data than expected for " << oex->abspath << endl;
+
+	return r;
+}
+
+/* the files small enough to go in their File Entry (File Entry sector, file). their contents are
+ * read by embed_file_heads() once every File Entry is laid out */
+static list< pair<UDF_Uint64,FileEntry*> >	embedded_files;
+
+/* reading the contents of the small files is most of the work of building the File Entries of a
+ * tree of small files, and it doesn't decide where anything goes. so it's done after the layout,
+ * shared out among worker processes like the digests of dedupe(): each reads its share of a batch
+ * into shared memory, and the contents are copied into their File Entries from there */
+#define EMBED_BATCH	65536
+
+class EmbedJob {
+	public:
+		pair<UDF_Uint64,FileEntry*>	*files;		/* this batch */
+		UDF_Uint8			*shared;	/* 2048 bytes each */
+};
+
+static int embed_job(void *ctx,size_t i) {
+	EmbedJob *j = (EmbedJob*)ctx;
+	read_file_head(j->files[i].second,j->shared + (i*2048),j->files[i].second->file_size);
+	return 1;
+}
+
+static int embed_file_heads() {
+	vector< pair<UDF_Uint64,FileEntry*> > v(embedded_files.begin(),embedded_files.end());
+	size_t n = v.size(),b,i;
+	embedded_files.clear();
+	if (n == 0) return 1;
+
+	UDF_Uint8 *shared = NULL;
+	if (n >= 256 && sysconf(_SC_NPROCESSORS_ONLN) > 1)
+		shared = (UDF_Uint8*)shared_memory((size_t)EMBED_BATCH * 2048);
+	if (!shared) {
+		/* a few, or one CPU: do it ourselves */
+		for (i=0;i < n;i++) {
+			OutputExtent *sx = &output_extents[v[i].first];
+			read_file_head(v[i].second,sx->content + 176,v[i].second->file_size);
+		}
+		return 1;
+	}
+
+	for (b=0;b < n;b += EMBED_BATCH) {
+		size_t m = (n - b) < EMBED_BATCH ? (n - b) : EMBED_BATCH;
+		EmbedJob job;
+		job.files = &v[b];
+		job.shared = shared;
+		if (!run_workers(m,embed_job,&job)) {
+			cerr << "ERROR: the contents of the small files could not all be read" << endl;
+			munmap(shared,(size_t)EMBED_BATCH * 2048);
+			return 0;
+		}
+
+		for (i=0;i < m;i++) {
+			OutputExtent *sx = &output_extents[v[b+i].first];
+			memcpy(sx->content + 176,shared + (i*2048),v[b+i].second->file_size);
+		}
+		if ((b + m) < n) memset(shared,0,(size_t)EMBED_BATCH * 2048);
+	}
+
+	munmap(shared,(size_t)EMBED_BATCH * 2048);
+	return 1;
+}
+
+/* the CRC of a File Entry or FID covers the whole descriptor (ECMA-167 3/7.2.6): the File Entry of
+ * a small file its contents, that of a directory kept in its File Entry its FIDs. so the CRCs are
+ * made once every descriptor is final, in two rounds (the FIDs, then the File Entries that may hold
+ * some), each shared out among worker processes like embed_file_heads() when it's a large tree.
+ * the descriptors are found by their tag: a File Entry or FID that gives the block it's in */
+#define CHECKSUM_MIN	4096
+
+class ChecksumJob {
+	public:
+		vector< pair<unsigned char*,UDF_Uint32> >	*desc;		/* descriptor, bytes after its tag */
+		UDF_Uint16					*shared;	/* their CRCs */
+};
+
+static int checksum_job(void *ctx,size_t i) {
+	ChecksumJob *j = (ChecksumJob*)ctx;
+	j->shared[i] = osta_cksum((*j->desc)[i].first + 16,(*j->desc)[i].second);
+	return 1;
+}
+
+static void checksum_fids(vector< pair<unsigned char*,UDF_Uint32> > &v,unsigned char *p,UDF_Uint32 len,UDF_Uint32 lbn) {
+	UDF_Uint32 o = 0;
+
+	while ((o + 38) <= len) {
+		UDF_tag_file_identifier_descriptor *fid = (UDF_tag_file_identifier_descriptor*)(p + o);
+		if (fid->DescriptorTag.TagIdentifier != UDFtag_FileIdentifierDescriptor || fid->DescriptorTag.TagLocation != lbn)
+			break;
+		UDF_Uint32 sz = (38 + fid->LengthOfImplementationUse + fid->LengthOfFileIdentifier + 3) & (~3);
+		if ((o + sz) > len) break;
+		v.push_back(pair<unsigned char*,UDF_Uint32>(p + o,sz - 16));
+		o += sz;
+	}
+}
+
+static int checksum_round(vector< pair<unsigned char*,UDF_Uint32> > &v) {
+	size_t n = v.size(),i;
+	UDF_Uint16 *shared = NULL;
+
+	if (n >= CHECKSUM_MIN && sysconf(_SC_NPROCESSORS_ONLN) > 1)
+		shared = (UDF_Uint16*)shared_memory(n * sizeof(UDF_Uint16));
+	if (shared) {
+		ChecksumJob job;
+		job.desc = &v;
+		job.shared = shared;
+		if (!run_workers(n,checksum_job,&job)) {
+			cerr << "ERROR: the CRCs of the File Entries and FIDs could not all be made" << endl;
+			munmap(shared,n * sizeof(UDF_Uint16));
+			return 0;
+		}
+	}
+
+	for (i=0;i < n;i++) {
+		UDF_tag *tag = (UDF_tag*)v[i].first;
+		LSETWORD(&tag->DescriptorCRC,shared ? shared[i] : osta_cksum(v[i].first + 16,v[i].second));
+		LSETWORD(&tag->DescriptorCRCLength,v[i].second);
+		UPDATE_UDF_tag(*tag);
+	}
+
+	if (shared) munmap(shared,n * sizeof(UDF_Uint16));
+	return 1;
+}
+
+static int descriptor_checksums() {
+	vector< pair<unsigned char*,UDF_Uint32> > fids,fes;
+	map<UDF_Uint64,OutputExtent>::iterator i;
+
+	for (i=output_extents.begin();i != output_extents.end();i++) {
+		OutputExtent *x = &i->second;
+		if (!x->content || x->content_length < 40) continue;
+
+		UDF_Uint32 lbn = metadata_lbn(x->start);
+		UDF_tag *tag = (UDF_tag*)x->content;
+		if (tag->TagLocation != lbn) continue;
+
+		UDF_Uint32 hdr,ea_len,ad_len;
+		if (tag->TagIdentifier == UDFtag_FileEntry && x->content_length >= 176) {
+			UDF_tag_file_entry_descriptor *fe = (UDF_tag_file_entry_descriptor*)x->content;
+			hdr = 176;
+			ea_len = fe->LengthOfExtendedAttributes;
+			ad_len = fe->LengthOfAllocationDescriptors;
+		}
+		else if (tag->TagIdentifier == UDFtag_ExtendedFileEntry && x->content_length >= 216) {
+			UDF_tag_extended_file_entry_descriptor *efe = (UDF_tag_extended_file_entry_descriptor*)x->content;
+			hdr = 216;
+			ea_len = efe->LengthOfExtendedAttributes;
+			ad_len = efe->LengthOfAllocationDescriptors;
+		}
+		else {
+			if (tag->TagIdentifier == UDFtag_FileIdentifierDescriptor)
+				checksum_fids(fids,x->content,x->content_length,lbn);
+			continue;
+		}
+		if ((hdr + ea_len + ad_len) > (UDF_Uint32)x->content_length) continue;
+
+		/* a directory with its FIDs where the allocation descriptors go */
+		UDF_icbtag *icb = &((UDF_tag_file_entry_descriptor*)x->content)->ICBTag;
+		if (icb->FileType == 4 && (icb->Flags & 7) == 3)
+			checksum_fids(fids,x->content + hdr + ea_len,ad_len,lbn);
+		fes.push_back(pair<unsigned char*,UDF_Uint32>(x->content,hdr - 16 + ea_len + ad_len));
+	}
+
+	return checksum_round(fids) && checksum_round(fes);
+}
+
+/* -bdmv: the navigation files (see bdmv_navigation()) that are laid out ahead of everything else */
+static list<FileEntry*> bdmv_navigation_files() {
+	map<UDF_Uint64,FileEntry>::iterator i;
+	list<FileEntry*> l;
+
+	if (!bdmv_mode) return l;
+	for (i=file_list.begin();i != file_list.end();i++) {
+		FileEntry *f = &i->second;
+		if (f->fixed_start || file_data_sectors(f) == 0 || !bdmv_navigation(f)) continue;
+		l.push_back(f);
+	}
+	return l;
+}
+
+/* -bdmv: place the data of the navigation files together, right after the root directory.
+ * they get a fixed start, file_data_extent() then finds them there */
+static void bdmv_place_navigation() {
+	list<FileEntry*> l = bdmv_navigation_files();
+	list<FileEntry*>::iterator li;
+
+	for (li=l.begin();li != l.end();li++) {
+		FileEntry *f = *li;
+		UDF_Uint64 first = f->same_as ? f->same_as : f->id;
+		if (dedupe_files && dedupe_extent.find(first) != dedupe_extent.end()) continue;
+		OutputExtent *e = NewOutputExtent(0,file_data_sectors(f));
+		f->fixed_start = e->start;
+		if (dedupe_files) dedupe_extent[first] = e->start;
+	}
+}
+
+/* -access-trace: the path of an entry in the image, relative to the root */
+static string image_path(const FileEntry *f) {
+	string p = f->name;
+	map<UDF_Uint64,FileEntry>::iterator i = file_list.find(f->parent);
+	while (f->parent != 0 && i != file_list.end()) {
+		p = i->second.name + "/" + p;
+		if (i->second.parent == 0) break;
+		i = file_list.find(i->second.parent);
+	}
+	return p;
+}
+
+/* -access-trace: one line per read, "<path> [count]", the path relative to the root of the image.
+ * a file listed more than once keeps its first place, and its counts add up */
+static int load_access_trace(const char *path) {
+	map<UDF_Uint64,FileEntry>::iterator i;
+	map<string,FileEntry*> by_path;
+	map<string,FileEntry*>::iterator bi;
+	char line[8192];
+	UDF_Uint64 order = 0;
+
+	FILE *fp = fopen(path,"r");
+	if (!fp) {
+		fprintf(stderr,"Cannot open access trace %s: %s\n",path,strerror(errno));
+		return 0;
+	}
+
+	for (i=file_list.begin();i != file_list.end();i++)
+		if (!(i->second.characteristics & 2)) by_path[image_path(&i->second)] = &i->second;
+
+	while (fgets(line,sizeof(line),fp)) {
+		char *e = line + strlen(line);
+		while (e > line && isspace(e[-1])) *--e = 0;
+
+		char *p = line;
+		while (*p == '/' || isspace(*p)) p++;
+		if (*p == 0 || *p == '#') continue;
+
+		/* a trailing number is the count */
+		UDF_Uint64 count = 1;
+		char *c = strrchr(p,' '),*t = NULL;
+		if (!c) c = strrchr(p,'\t');
+		if (c && c[1]) {
+			UDF_Uint64 n = strtoull(c + 1,&t,10);
+			if (t && *t == 0) {
+				count = n;
+				while (c > p && isspace(c[-1])) c--;
+				*c = 0;
+			}
+		}
+
+		bi = by_path.find(p);
+		if (bi == by_path.end()) {
+			cerr << "WARNING: " << p << " of the access trace is not in the image" << endl;
+			continue;
+		}
+		FileEntry *f = bi->second;
+		if (!f->trace_order) f->trace_order = ++order;
+		f->trace_count += count;
+	}
+
+	fclose(fp);
+	return 1;
+}
+
+/* -access-trace: the file's data goes with the rest of the trace. hard links are left alone, like
+ * the navigation files of -bdmv, and so is everything that has its place already */
+static int access_traced(const FileEntry *f) {
+	return f->trace_order && !(f->characteristics & 2) && !f->link_id && !f->existing_fe &&
+		!f->fixed_start && file_data_sectors(f) > 0 && !bdmv_navigation(f);
+}
+
+static bool trace_before(const FileEntry *a,const FileEntry *b) {
+	/* -cav: the hottest last, the furthest out */
+	if (trace_cav && a->trace_count != b->trace_count) return a->trace_count < b->trace_count;
+	return a->trace_order < b->trace_order;
+}
+
+/* -access-trace: the traced files in the order their data is laid out */
+static list<FileEntry*> access_trace_files() {
+	map<UDF_Uint64,FileEntry>::iterator i;
+	list<FileEntry*> l;
+
+	if (access_trace == "") return l;
+	for (i=file_list.begin();i != file_list.end();i++)
+		if (access_traced(&i->second)) l.push_back(&i->second);
+	l.sort(trace_before);
+	return l;
+}
+
+static UDF_Uint64 trace_tail_start = 0;	/* -cav: where the size planner found the end of everything else */
+
+/* -access-trace: the data of the traced files in one run, in trace order: after the root directory
+ * (and the navigation files of -bdmv), or with -cav where the size planner says everything else
+ * ends. -align and the aligned units of -bdmv don't apply, the run has no gaps */
+static void access_trace_place() {
+	list<FileEntry*> l = access_trace_files(),run;
+	list<FileEntry*>::iterator li;
+	UDF_Uint64 total = 0;
+
+	for (li=l.begin();li != l.end();li++) {
+		FileEntry *f = *li;
+		UDF_Uint64 first = f->same_as ? f->same_as : f->id;
+		if (dedupe_files && !dedupe_extent.insert(pair<UDF_Uint64,UDF_Uint64>(first,0)).second) continue;
+		run.push_back(f);
+		total += file_data_sectors(f);
+	}
+	if (total == 0) return;
+
+	UDF_Uint64 start = trace_cav ? trace_tail_start : first_fit(output_extents,output_extents_solid,total);
+	for (li=run.begin();li != run.end();li++) {
+		FileEntry *f = *li;
+		OutputExtent *e = NewOutputExtent(start,file_data_sectors(f));
+		f->fixed_start = e->start;
+		if (dedupe_files) dedupe_extent[f->same_as ? f->same_as : f->id] = e->start;
+		start = e->end;
+	}
+}
+
+/* the output extent that holds a file's data. data that already has its place in the
+ * image (see fixed_start) keeps it, everything else is allocated here */
+static OutputExtent *file_data_extent(FileEntry *file,UDF_Uint64 sectors) {
+	OutputExtent *fex;
+	if (file->fixed_start) {
+		fex = &output_extents[file->fixed_start];
+		if (fex->end != (fex->start + sectors))
+			cerr << "BUG: Fixed extent for " << file->abspath << " has the wrong size" << endl;
+		if (dedupe_files)
+			dedupe_extent.insert(pair<UDF_Uint64,UDF_Uint64>(file->same_as ? file->same_as : file->id,fex->start));
+	}
+	else if (dedupe_files) {
+		/* whichever of the same files comes first allocates */
+		UDF_Uint64 first = file->same_as ? file->same_as : file->id;
+		map<UDF_Uint64,UDF_Uint64>::iterator d = dedupe_extent.find(first);
+		if (d != dedupe_extent.end())
+			fex = &output_extents[d->second];
+		else {
+			fex = NewOutputExtent(0,sectors,data_alignment(sectors,file));
+			dedupe_extent[first] = fex->start;
+		}
+	}
+	else {
+		fex = NewOutputExtent(0,sectors,data_alignment(sectors,file));
+	}
+
+	/* the report and hash table list every file of a shared extent, the other links
+	 * of a hard linked file included */
+	if (fex->file && fex->file != file)
+		shared_extents.insert(pair<UDF_Uint64,FileEntry*>(fex->start,file));
+	if (file->link_id) {
+		list<FileEntry*>::iterator li;
+		list<FileEntry*> &links = link_members[file->link_id];
+		for (li=links.begin();li != links.end();li++)
+			if (*li != file) shared_extents.insert(pair<UDF_Uint64,FileEntry*>(fex->start,*li));
+	}
+	return fex;
+}
+
+/* an Identifier Suffix of the UDF domain: the UDF revision, least significant byte first, then one more byte */
+static const char *UDF_suffix(char *s,UDF_Uint8 b) {
+	s[0] = udf_revision & 0xFF;
+	s[1] = udf_revision >> 8;
+	s[2] = b;
+	s[3] = 0;
+	return s;
+}
+
+/* -udf-rev 2.50: the Extended File Entry of the metadata file (type 250) or its mirror (251) in
+ * the physical partition, describing the metadata partition's sectors at 'start' */
+static void UDF_metadata_file_entry(OutputExtent *x,UDF_Uint8 file_type,UDF_Uint64 start) {
+	unsigned char raw[2048];
+	UDF_tag_extended_file_entry_descriptor &efe = *((UDF_tag_extended_file_entry_descriptor*)raw);
+	UDF_Uint64 length = (metadata_end - metadata_start) << 11ULL;
+	UDF_Uint32 used = 0;
+
+	memset(raw,0,sizeof(raw));
+	SET_UDF_tag(efe.DescriptorTag,UDFtag_ExtendedFileEntry,x->start - PartitionStart,DESCRIPTOR_VERSION);
+	UPDATE_UDF_tag(efe.DescriptorTag);
+	efe.ICBTag.StrategyType = 4;
+	efe.ICBTag.MaximumNumberOfEntries = 1;
+	efe.ICBTag.FileType = file_type;
+	efe.ICBTag.Flags = 0x230;	/* non-relocatable, short_ad */
+	efe.Uid = -1;
+	efe.Gid = -1;
+	efe.FileLinkCount = 1;
+	efe.InformationLength = efe.ObjectSize = length;
+	efe.LogicalBlocksRecorded = length >> 11ULL;
+	UDF_timestamp_set(efe.AccessDateAndTime,build_time);
+	UDF_timestamp_set(efe.ModificationDateAndTime,build_time);
+	UDF_timestamp_set(efe.CreationDateAndTime,build_time);
+	UDF_timestamp_set(efe.AttributeDateAndTime,build_time);
+	efe.Checkpoint = 1;
+	SET_UDF_regid(efe.ImplementationIdentifier,0,"*mkudfiso","");
+	for (UDF_Uint64 ofs=0;ofs < length && (216 + used + 8) <= 2048;used += 8) {
+		UDF_Uint32 l = ((length - ofs) > UDF_MAX_EXTENT) ? UDF_MAX_EXTENT : (UDF_Uint32)(length - ofs);
+		LSETDWORD(raw + 216 + used,l);
+		LSETDWORD(raw + 216 + used + 4,start - PartitionStart + (ofs >> 11ULL));
+		ofs += l;
+	}
+	efe.LengthOfAllocationDescriptors = used;
+	SET_UDF_tag_checksum(efe.DescriptorTag,216 - 16 + used);
+	x->setContent(raw,216 + used);
+}
+
+/* -udf-rev 2.50: the File Entries are made as File Entries, with room for the 40 bytes more of an
+ * Extended File Entry (see FE_HEADER_SIZE), and turned into one once they're complete */
+static void UDF_extended_file_entry(OutputExtent *x) {
+	UDF_tag_file_entry_descriptor *fe = (UDF_tag_file_entry_descriptor*)(x->content);
+	unsigned char raw[2048];
+	UDF_tag_extended_file_entry_descriptor &efe = *((UDF_tag_extended_file_entry_descriptor*)raw);
+	UDF_Uint32 ad_len = fe->LengthOfAllocationDescriptors;
+
+	memset(raw,0,sizeof(raw));
+	memcpy(raw,fe,56);	/* tag, ICB tag, ownership and permissions, link count, record format */
+	efe.DescriptorTag.TagIdentifier = UDFtag_ExtendedFileEntry;
+	efe.InformationLength = efe.ObjectSize = fe->InformationLength;
+	efe.LogicalBlocksRecorded = fe->LogicalBlocksRecorded;
+	efe.AccessDateAndTime = fe->AccessDateAndTime;
+	efe.ModificationDateAndTime = fe->ModificationDateAndTime;
+	efe.CreationDateAndTime = fe->ModificationDateAndTime;
+	efe.AttributeDateAndTime = fe->AttributeDateAndTime;
+	efe.Checkpoint = fe->Checkpoint;
+	efe.ImplementationIdentifier = fe->ImplementationIdentifier;
+	efe.UniqueId = fe->UniqueId;
+	efe.LengthOfAllocationDescriptors = ad_len;
+	memcpy(raw + 216,x->content + 176,ad_len);
+	x->setContent(raw,216 + ad_len);	/* CRC: descriptor_checksums() */
+}
+
+/* what the mirror copies: sector s as laid out, zeros where there's nothing */
+static void metadata_mirror_sector(UDF_Uint64 s,unsigned char *buf) {
+	map<UDF_Uint64,OutputExtent>::iterator i = output_extents.upper_bound(s);
+
+	memset(buf,0,2048);
+	if (i == output_extents.begin()) return;
+	i--;
+
+	OutputExtent *e = &i->second;
+	UDF_Uint64 o = (s - e->start) << 11ULL;
+	if (s >= e->end || !e->content || o >= (UDF_Uint64)e->content_length) return;
+	memcpy(buf,e->content + o,min((UDF_Uint64)2048,e->content_length - o));
+}
+
+/* a File Identifier Descriptor for a directory at dir_lbn, pointing to the File Entry at fe_lbn */
+static void UDF_file_identifier(unsigned char *dir_cur,UDF_Uint32 dir_lbn,FileEntry *oex,UDF_Uint32 fe_lbn) {
+	UDF_tag_file_identifier_descriptor *fent =
+		(UDF_tag_file_identifier_descriptor*)dir_cur;
+	SET_UDF_tag(fent->DescriptorTag,UDFtag_FileIdentifierDescriptor,dir_lbn,DESCRIPTOR_VERSION);
+	UPDATE_UDF_tag(fent->DescriptorTag);
+	fent->FileVersionNumber = 1;
+	fent->FileCharacteristics = oex->characteristics;
+	fent->LengthOfFileIdentifier = oex->name.length()+1;	/* doesn't count d-string type? */
+	fent->ICB.ExtentLength = 2048;
+	fent->ICB.ExtentLocation.LogicalBlockNumber = fe_lbn;
+	fent->ICB.ExtentLocation.PartitionReferenceNumber = METADATA_PARTITION;
+	UDF_dstring_strncpyne((dir_cur+38),(oex->name.length()+1),oex->name.c_str());
+	/* CRC: descriptor_checksums() */
+}
+
+/* -cluster-metadata: UDF_subdirectory() doesn't go down into the subdirectories or allocate the data
+ * of the files itself, it queues them. all the directories and File Entries are laid out first,
+ * level by level, and the data of the files follows in the same order */
+class ClusterDir {
+	public:
+		ClusterDir(UDF_short_ad *e,OutputExtent *p,UDF_Uint64 d,OutputExtent *s) {
+			extent = e;
+			parent = p;
+			dir_id = d;
+			self = s;
+		}
+	public:
+		UDF_short_ad	*extent;
+		OutputExtent	*parent;
+		UDF_Uint64	dir_id;
+		OutputExtent	*self;
+};
+
+/* a step of the walk over the tree of UDF_subdirectory() and plan_directory(): a directory, or the
+ * data of a directory's files once everything below it is done */
+class DirectoryTask {
+	public:
+		DirectoryTask(const ClusterDir &d) : dir(d) {
+			dir_id = d.dir_id;
+			dir_start = 0;
+			files_only = 0;
+		}
+		DirectoryTask(UDF_Uint64 d,UDF_Uint64 s) : dir(NULL,NULL,d,NULL) {
+			dir_id = d;
+			dir_start = s;
+			files_only = 0;
+		}
+		void swap(DirectoryTask &b) {
+			std::swap(dir,b.dir);
+			std::swap(dir_id,b.dir_id);
+			std::swap(dir_start,b.dir_start);
+			std::swap(files_only,b.files_only);
+			file_ents.swap(b.file_ents);
+			files.swap(b.files);
+		}
+	public:
+		ClusterDir	dir;			/* the layout's directory ... */
+		UDF_Uint64	dir_id,dir_start;	/* ... the size planner's */
+		int		files_only;
+		list< pair<UDF_Uint64,FileEntry*> > file_ents;	/* File Entry sector, file */
+		list<FileEntry*>	files;
+};
+
+static list<ClusterDir>				cluster_dirs;
+static list< pair<UDF_Uint64,FileEntry*> >	cluster_files;	/* File Entry sector, file */
+
+/* allocate the data of a file and describe it with short_ads: one per UDF_MAX_EXTENT bytes at most,
+ * and (-sparse) unrecorded ones for the runs of zeros. what doesn't fit in the File Entry goes on
+ * in a chain of Allocation Extent Descriptors, allocated after the data. with a metadata partition
+ * they're long_ads into the physical partition, and the AEDs are in the metadata partition */
+static void UDF_file_allocation(FileEntry *file,OutputExtent *sx) {
+	UDF_tag_file_entry_descriptor *fed = (UDF_tag_file_entry_descriptor*)(sx->content);
+	map<UDF_Uint64,UDF_Uint64>::iterator hi = file->holes.begin();
+	vector< pair<UDF_Uint32,UDF_Uint32> > ads;	/* (length with type, position) */
+	UDF_Uint64 ofs = 0;
+
+	/* make the output extent for the file */
+	fed->LogicalBlocksRecorded = file_data_sectors(file);
+	OutputExtent *fex = file_data_extent(file,fed->LogicalBlocksRecorded);
+
+	UDF_Uint32 s = fex->start - PartitionStart;
+	while (ofs < file->file_size) {
+		int hole = (hi != file->holes.end() && hi->first == ofs);
+		UDF_Uint64 len = hole ? hi->second : ((hi != file->holes.end() ? hi->first : file->file_size) - ofs);
+		if (hole) hi++;
+		ofs += len;
+
+		while (len > 0) {
+			UDF_Uint32 l = (len > UDF_MAX_EXTENT) ? UDF_MAX_EXTENT : (UDF_Uint32)len;
+			if (hole) {
+				ads.push_back(pair<UDF_Uint32,UDF_Uint32>(l | 0x80000000,0));	/* not recorded, not allocated */
+			}
+			else {
+				ads.push_back(pair<UDF_Uint32,UDF_Uint32>(l,s));
+				s += (l + 2047) >> 11;
 			}
+			len -= l;
 		}
 	}
 
-	if (content_root.length() < 1) {
-		fprintf(stderr,"You must specify a directory who's contents are to be made into a UDF filesystem\n");
-		return 0;
+	if ((s+PartitionStart) != fex->end) {
+		cerr << "BUG: Extent computation ended at " << s << " expected " << fex->end << endl;
+	}
+	if (ads.size() != file_extent_count(file)) {
+		cerr << "BUG: Miscalculated the number of extents" << endl;
 	}
 
-	return 1;
+	/* the File Entry, then as many AEDs as it takes. each but the last ends with a pointer to the next */
+	unsigned char *area = sx->content + 176;
+	UDF_Uint32 room = FE_MAX_ADS,used;
+	UDF_tag_allocation_extent_descriptor *aed = NULL;
+	OutputExtent *aex = NULL;
+	UDF_Uint32 prev = metadata_lbn(sx->start);
+	size_t i = 0;
+	if (FE_AD_SIZE == 16) fed->ICBTag.Flags = (fed->ICBTag.Flags & ~7) | 1;	/* long_ad */
+	while (1) {
+		size_t n = ads.size() - i;
+		int more = (n > room);
+		if (more) n = room - 1;
+
+		/* a long_ad's partition reference (0, the physical partition) and implementation use stay zero */
+		for (used=0;n > 0;n--,i++,used += FE_AD_SIZE) {
+			LSETDWORD(area + used,ads[i].first);
+			LSETDWORD(area + used + 4,ads[i].second);
+		}
+
+		OutputExtent *next = NULL;
+		if (more) {
+			next = NewMetadataExtent(0,1);
+			LSETDWORD(area + used,2048 | 0xC0000000);	/* the next extent of allocation descriptors */
+			LSETDWORD(area + used + 4,metadata_lbn(next->start));
+			if (FE_AD_SIZE == 16) LSETWORD(area + used + 8,METADATA_PARTITION);
+			used += FE_AD_SIZE;
+		}
+		if (aed) {
+			aed->LengthOfAllocationDescriptors = used;
+			SET_UDF_tag_checksum(aed->DescriptorTag,8 + used);
+			aex->setContent(aed,24 + used);
+			prev = metadata_lbn(aex->start);
+			delete[] (unsigned char*)aed;
+		}
+		else {
+			fed->LengthOfAllocationDescriptors = used;
+		}
+		if (!next) break;
+
+		/* the next AED */
+		aex = next;
+		aed = (UDF_tag_allocation_extent_descriptor*)(new unsigned char[2048]);
+		memset(aed,0,2048);
+		SET_UDF_tag(aed->DescriptorTag,UDFtag_AllocationExtentDescriptor,metadata_lbn(aex->start),DESCRIPTOR_VERSION);
+		UPDATE_UDF_tag(aed->DescriptorTag);
+		aed->PreviousAllocationExtentLocation = prev;
+		area = ((unsigned char*)aed) + 24;
+		room = AED_MAX_ADS;
+	}
+
+	if (!fex->file) fex->setFile(file);
 }
 
-static void UDF_subdirectory(UDF_short_ad* DirExtent,OutputExtent* parent,UDF_Uint64 dir_id,OutputExtent* self) {
+/* one directory: its FIDs, and the File Entries of everything in it. the subdirectories and the
+ * files with data, which still need their part, are handed back (File Entry sector, entry).
+ * the root (dir_id 0) is its own parent, and its FIDs always go in the sector after its File Entry */
+static void UDF_directory(OutputExtent* parent,UDF_Uint64 dir_id,OutputExtent* self,
+	list< pair<UDF_Uint64,FileEntry*> > &dir_ents,list< pair<UDF_Uint64,FileEntry*> > &file_ents) {
 	UDF_tag_file_entry_descriptor *DirFileEntryTag =
 		(UDF_tag_file_entry_descriptor*)(self->content);
 	UDF_short_ad *DirFileEntryTagExtent =
 		(UDF_short_ad*)(self->content + 176);
 
-	/* now generate the root directory */
+	/* now generate the directory */
 	OutputExtent *DirDirectory = NULL; {
 		map<UDF_Uint64,FileEntry>::iterator i;
 		FileEntry *oex = NULL;
@@ -566,8 +4307,19 @@ static void UDF_subdirectory(UDF_short_ad* DirExtent,OutputExtent* parent,UDF_Ui
 			exit(1);
 		}
 
-/* create the directory */
-		DirDirectory = NewOutputExtent(0,(alloc_sz+2047) >> 11);
+/* create the directory. if the FIDs fit where the allocation descriptors go, they go there instead
+ * (ECMA-167 4/14.6.8), and their tags give the File Entry's own block */
+		int is_root = (dir_id == 0);
+		UDF_Uint64 dir_sectors = directory_sectors(alloc_sz,is_root);
+		UDF_Uint32 dir_lbn = metadata_lbn(self->start);
+		if (dir_sectors) {
+			DirDirectory = NewMetadataExtent(is_root ? self->start+1 : 0,dir_sectors,data_alignment(dir_sectors,NULL));
+			dir_lbn = metadata_lbn(DirDirectory->start);
+		}
+		if (is_root) {
+			bdmv_place_navigation();
+			access_trace_place();
+		}
 		unsigned char *dir_raw = new unsigned char[alloc_sz];
 		unsigned char *dir_cur = dir_raw;
 		memset(dir_raw,0,alloc_sz);
@@ -576,16 +4328,14 @@ static void UDF_subdirectory(UDF_short_ad* DirExtent,OutputExtent* parent,UDF_Ui
 		{
 			UDF_tag_file_identifier_descriptor *fent =
 				(UDF_tag_file_identifier_descriptor*)dir_cur;
-			SET_UDF_tag(fent->DescriptorTag,UDFtag_FileIdentifierDescriptor,
-				DirDirectory->start - PartitionStart);
+			SET_UDF_tag(fent->DescriptorTag,UDFtag_FileIdentifierDescriptor,dir_lbn,DESCRIPTOR_VERSION);
 			UPDATE_UDF_tag(fent->DescriptorTag);
 			fent->FileVersionNumber = 1;
 			fent->FileCharacteristics = 0x0A;	/* parent node */
 			fent->LengthOfFileIdentifier = 0;
 			fent->ICB.ExtentLength = 2048;
-			fent->ICB.ExtentLocation.LogicalBlockNumber = parent->start - PartitionStart;	/* parent */
-			fent->ICB.ExtentLocation.PartitionReferenceNumber = 0;
-			SET_UDF_tag_checksum(fent->DescriptorTag,2);
+			fent->ICB.ExtentLocation.LogicalBlockNumber = metadata_lbn(parent->start);	/* parent */
+			fent->ICB.ExtentLocation.PartitionReferenceNumber = METADATA_PARTITION;
 			dir_cur += 40;
 #if 0
 			/* argh apparently file link counts matter to every UDF reader out there,
@@ -600,8 +4350,6 @@ static void UDF_subdirectory(UDF_short_ad* DirExtent,OutputExtent* parent,UDF_Ui
 #endif
 		}
 
-		list< pair<UDF_Uint64,FileEntry*> > dir_ents;
-		list< pair<UDF_Uint64,FileEntry*> > file_ents;
 		for (	i  = file_list.find(parent_dir_to_first_file[dir_id]);
 			i != file_list.end() && i->second.parent == dir_id;i++) {
 			oex = &i->second;
@@ -617,29 +4365,42 @@ static void UDF_subdirectory(UDF_short_ad* DirExtent,OutputExtent* parent,UDF_Ui
 				exit(1);
 			}
 
+			/* a file in the image being appended to keeps its File Entry */
+			if (oex->existing_fe) {
+				UDF_file_identifier(dir_cur,dir_lbn,oex,oex->existing_fe);
+				dir_cur += sz;
+				continue;
+			}
+
+			/* another link to a file that has its File Entry already */
+			if (oex->link_id && link_fe.find(oex->link_id) != link_fe.end()) {
+				UDF_file_identifier(dir_cur,dir_lbn,oex,link_fe[oex->link_id]);
+				dir_cur += sz;
+				continue;
+			}
+
 			/* create the file entries to make them happen */
 			int sectorsneeded = 1;
-			/* TODO: For files larger than 231GB, multiple sectors are needed for the allocation extent array */
-			OutputExtent *FileEntry2 = NewOutputExtent(0,sectorsneeded);
+			OutputExtent *FileEntry2 = NewMetadataExtent(0,sectorsneeded);
 			unsigned char FileEntry2TagRaw[2048];
 			memset(FileEntry2TagRaw,0,sizeof(FileEntry2TagRaw));
 			UDF_tag_file_entry_descriptor &FileEntry2Tag = *((UDF_tag_file_entry_descriptor*)FileEntry2TagRaw);
 			memset(&FileEntry2Tag,0,sizeof(FileEntry2Tag));
 			SET_UDF_tag(FileEntry2Tag.DescriptorTag,UDFtag_FileEntry,
-				FileEntry2->start - PartitionStart);
+				metadata_lbn(FileEntry2->start),DESCRIPTOR_VERSION);
 			UPDATE_UDF_tag(FileEntry2Tag.DescriptorTag);
 			FileEntry2Tag.ICBTag.PriorRecordedNumberOfDirectEntries = 0;
 			FileEntry2Tag.ICBTag.StrategyType = 4;
 			LSETWORD(&FileEntry2Tag.ICBTag.StrategyParameter,0);
 			FileEntry2Tag.ICBTag.MaximumNumberOfEntries = 1;
 			FileEntry2Tag.ICBTag.FileType = (oex->characteristics & 2) ? 4 : 5; /* file or folder? */
-			FileEntry2Tag.ICBTag.ParentICBLocation.LogicalBlockNumber = parent->start - PartitionStart;
-			FileEntry2Tag.ICBTag.ParentICBLocation.PartitionReferenceNumber = 0;
+			FileEntry2Tag.ICBTag.ParentICBLocation.LogicalBlockNumber = metadata_lbn(parent->start);
+			FileEntry2Tag.ICBTag.ParentICBLocation.PartitionReferenceNumber = METADATA_PARTITION;
 			FileEntry2Tag.ICBTag.Flags = 0x230;	/* non-relocatable, short_ad */
 			FileEntry2Tag.Uid = -1;
 			FileEntry2Tag.Gid = -1;
 			FileEntry2Tag.Permissions = oex->permissions;
-			FileEntry2Tag.FileLinkCount = 1;
+			FileEntry2Tag.FileLinkCount = oex->link_id ? link_members[oex->link_id].size() : 1;
 			FileEntry2Tag.RecordFormat = 0;
 			FileEntry2Tag.RecordDisplayAttributes = 0;
 			FileEntry2Tag.RecordLength = 0;
@@ -659,135 +4420,554 @@ static void UDF_subdirectory(UDF_short_ad* DirExtent,OutputExtent* parent,UDF_Ui
 			}
 			/* if the file is small enough we can stick the contents directly INTO the descriptor
 			 * where the allocation extents normally go. See ECMA-167 4/14.6 "ICB tag" */
-			else if (FileEntry2Tag.InformationLength < (2048-176)) {
+			else if (FileEntry2Tag.InformationLength < FE_EMBED_MAX) {
 				FileEntry2Tag.ICBTag.Flags = 0x233;	/* non-relocateable, the allocation extent area IS the file content */
 				FileEntry2Tag.LengthOfAllocationDescriptors = FileEntry2Tag.InformationLength;
 				FileEntry2Tag.LogicalBlocksRecorded = 0;
 
-				if (extra_large_chdir(oex->path.c_str()) < 0) {
-					cerr << "Cannot enter " << oex->path << endl;
-				}
-				else {
-					int fd = open(oex->name.c_str(),O_RDONLY);
-					if (fd < 0) {
-						cerr << "Cannot open " << oex->abspath << endl;
-					}
-					else {
-						int r = read(fd,((unsigned char*)(&FileEntry2Tag))+176,FileEntry2Tag.InformationLength);
-						if (r < FileEntry2Tag.InformationLength)
-							cerr << "WARNING: Read less data than expected for " << oex->abspath << endl;
-						close(fd);
-					}
-				}
+				embedded_files.push_back(pair<UDF_Uint64,FileEntry*>(FileEntry2->start,oex));
 			}
 			else {
 				/* add to list */
 				pair<UDF_Uint64,FileEntry*> po(FileEntry2->start,&file_list[i->first]);
 				file_ents.push_back(po);
 			}
-			SET_UDF_tag_checksum(FileEntry2Tag.DescriptorTag,2);
 			FileEntry2->setContent(&FileEntry2Tag,2048);
 
 			/* create the directory entry */
-			UDF_tag_file_identifier_descriptor *fent =
-				(UDF_tag_file_identifier_descriptor*)dir_cur;
-			SET_UDF_tag(fent->DescriptorTag,UDFtag_FileIdentifierDescriptor,
-				DirDirectory->start - PartitionStart);
-			UPDATE_UDF_tag(fent->DescriptorTag);
-			fent->FileVersionNumber = 1;
-			fent->FileCharacteristics = oex->characteristics;
-			fent->LengthOfFileIdentifier = oex->name.length()+1;
-			fent->ICB.ExtentLength = 2048;
-			fent->ICB.ExtentLocation.LogicalBlockNumber = FileEntry2->start - PartitionStart;
-			fent->ICB.ExtentLocation.PartitionReferenceNumber = 0;
-			UDF_dstring_strncpyne((dir_cur+38),(oex->name.length()+1),oex->name.c_str());
-			SET_UDF_tag_checksum(fent->DescriptorTag,2);
+			UDF_file_identifier(dir_cur,dir_lbn,oex,metadata_lbn(FileEntry2->start));
+			if (oex->link_id) link_fe[oex->link_id] = metadata_lbn(FileEntry2->start);
 
 			/* advance */
 			dir_cur += sz;
 		}
-		DirDirectory->setContent(dir_raw,alloc_sz);
-		delete dir_raw;
-
 		DirFileEntryTag->InformationLength = alloc_sz;
-		DirFileEntryTag->LogicalBlocksRecorded = (alloc_sz + 2047LL) >> 11LL;
-		DirFileEntryTagExtent->ExtentLength = alloc_sz;
-		DirFileEntryTagExtent->ExtentPosition = DirDirectory->start - PartitionStart;
-		DirFileEntryTag->LengthOfAllocationDescriptors = 8;
-		SET_UDF_tag_checksum(DirFileEntryTag->DescriptorTag,2);
+		if (DirDirectory) {
+			DirDirectory->setContent(dir_raw,alloc_sz);
+			DirFileEntryTag->LogicalBlocksRecorded = (alloc_sz + 2047LL) >> 11LL;
+			DirFileEntryTagExtent->ExtentLength = alloc_sz;
+			DirFileEntryTagExtent->ExtentPosition = dir_lbn;
+			DirFileEntryTag->LengthOfAllocationDescriptors = 8;
+		}
+		else {
+			DirFileEntryTag->ICBTag.Flags = (DirFileEntryTag->ICBTag.Flags & ~7) | 3;
+			DirFileEntryTag->LogicalBlocksRecorded = 0;
+			memcpy(self->content + 176,dir_raw,alloc_sz);
+			DirFileEntryTag->LengthOfAllocationDescriptors = alloc_sz;
+		}
+		delete dir_raw;
+	}
+}
 
-		pair<UDF_Uint64,FileEntry*> prpair;
-		list< pair<UDF_Uint64,FileEntry*> >::iterator pri;
+/* a directory and everything below it, depth first: each subdirectory with everything below it in
+ * turn, then the data of the directory's files. the tree is walked with a stack of its own rather
+ * than by recursion, so a deep tree can't run out of stack (plan_directory() walks it the same way) */
+static void UDF_subdirectory(UDF_short_ad* DirExtent,OutputExtent* parent,UDF_Uint64 dir_id,OutputExtent* self) {
+	list<DirectoryTask> stack;
+	list< pair<UDF_Uint64,FileEntry*> >::iterator pri;
+	list< pair<UDF_Uint64,FileEntry*> >::reverse_iterator rpri;
 
-		/* put folders in */
-		for (pri=dir_ents.begin();pri != dir_ents.end();pri++) {
-			UDF_Uint64 sector = pri->first;
-			FileEntry* file = pri->second;
-			OutputExtent *sx = &output_extents[sector];
-			UDF_subdirectory(DirFileEntryTagExtent,self,file->id,sx);
-		}
-		dir_ents.clear();
+	stack.push_back(DirectoryTask(ClusterDir(DirExtent,parent,dir_id,self)));
+	while (!stack.empty()) {
+		DirectoryTask t(0,0);
+		t.swap(stack.back());
+		stack.pop_back();
 
 		/* put files in */
-		for (pri=file_ents.begin();pri != file_ents.end();pri++) {
-			UDF_Uint64 sector = pri->first;
-			FileEntry* file = pri->second;
-			OutputExtent *sx = &output_extents[sector];
-			if (!sx->content) {
-				cerr << "Unexpected: Sector " << sector << " does not have contents" << endl;
-				continue;
+		if (t.files_only) {
+			for (pri=t.file_ents.begin();pri != t.file_ents.end();pri++) {
+				UDF_Uint64 sector = pri->first;
+				FileEntry* file = pri->second;
+				OutputExtent *sx = &output_extents[sector];
+				if (!sx->content) {
+					cerr << "Unexpected: Sector " << sector << " does not have contents" << endl;
+					continue;
+				}
+
+				UDF_file_allocation(file,sx);
 			}
+			continue;
+		}
+
+		list< pair<UDF_Uint64,FileEntry*> > dir_ents;
+		OutputExtent *dself = t.dir.self;
+		UDF_directory(t.dir.parent,t.dir.dir_id,dself,dir_ents,t.file_ents);
+		UDF_short_ad *DirFileEntryTagExtent = (UDF_short_ad*)(dself->content + 176);
+
+		/* put folders in (-cluster-metadata: later, as the files) */
+		if (cluster_metadata) {
+			for (pri=dir_ents.begin();pri != dir_ents.end();pri++)
+				cluster_dirs.push_back(ClusterDir(DirFileEntryTagExtent,dself,pri->second->id,&output_extents[pri->first]));
+			cluster_files.splice(cluster_files.end(),t.file_ents);
+			continue;
+		}
+		t.files_only = 1;
+		stack.push_back(DirectoryTask(0,0));
+		stack.back().swap(t);
+		for (rpri=dir_ents.rbegin();rpri != dir_ents.rend();rpri++)
+			stack.push_back(DirectoryTask(ClusterDir(DirFileEntryTagExtent,dself,rpri->second->id,&output_extents[rpri->first])));
+	}
+}
 
-			UDF_tag_file_entry_descriptor *fed =
-				(UDF_tag_file_entry_descriptor*)(sx->content);
+/* the exact size of the ISO, worked out before anything is laid out: the allocations the layout
+ * in main() and UDF_subdirectory() are going to make, in the same order, on a map of bare sector
+ * ranges. no descriptors are built and nothing is read. must be kept in step with the layout */
+static map<UDF_Uint64,UDF_Uint64>	plan_extents;		/* start -> end (exclusive) */
+static UDF_Uint64			plan_solid = 16;
+static set<UDF_Uint64>			plan_deduped;		/* -dedupe: contents that have their extent */
+static set<UDF_Uint64>			plan_linked;		/* hard links that have their File Entry */
+static list<FileEntry*>			plan_dirs,plan_files;	/* -cluster-metadata: what waits for the rest of the metadata */
+static UDF_Uint64			plan_metadata_next = 0;	/* -udf-rev 2.50: the metadata partition, reserved as a whole */
+static UDF_Uint64			plan_metadata_end = 0;
+static UDF_Uint64			plan_trace_sectors = 0;	/* -access-trace -cav: the run that goes after everything else */
+
+static UDF_Uint64 plan_alloc(UDF_Uint64 start,UDF_Uint64 size,UDF_Uint64 align=1) {
+	if (start == 0) start = first_fit(plan_extents,plan_solid,size,align);
+	plan_extents[start] = start + size;
+	return start;
+}
 
-			int allocs_needed = 1;
-			UDF_Uint64 ssz = fed->InformationLength;
-			UDF_short_ad *sad = (UDF_short_ad*)(sx->content + 176);
+/* File Entries, directories and AEDs (see NewMetadataExtent()). the extents and the placeholder
+ * after them are kept the same way, first fit walks them the same way */
+static UDF_Uint64 plan_metadata(UDF_Uint64 start,UDF_Uint64 size,UDF_Uint64 align=1) {
+	if (udf_revision < 0x0250) return plan_alloc(start,size,align);
+	start = plan_alloc(plan_metadata_next,size);
+	plan_metadata_next += size;
+	if (plan_metadata_next < plan_metadata_end)
+		plan_alloc(plan_metadata_next,plan_metadata_end - plan_metadata_next);
+	return start;
+}
 
-			/* how many allocation extents */
-			while (ssz >= 1048576000) {
-				ssz -= 1048576000;
-				allocs_needed++;
-			}
+static void plan_file_data(FileEntry *f) {
+	int first = dedupe_files ? plan_deduped.insert(f->same_as ? f->same_as : f->id).second : 1;
+	if (!f->fixed_start && first && !bdmv_navigation(f) && !access_traced(f)) plan_alloc(0,file_data_sectors(f),data_alignment(file_data_sectors(f),f));
 
-			fed->LengthOfAllocationDescriptors =
-				allocs_needed * 8;
+	UDF_Uint64 aeds = file_aed_sectors(f);
+	while (aeds-- > 0) plan_metadata(0,1);
+}
 
-			/* make the output extent for the file */
-			OutputExtent *fex = NewOutputExtent(0,fed->LogicalBlocksRecorded);
+/* one directory and the File Entries of everything in it. what still needs its part is handed back */
+static void plan_directory_entries(UDF_Uint64 dir_id,UDF_Uint64 dir_start,list<FileEntry*> &dirs,list<FileEntry*> &files) {
+	map<UDF_Uint64,FileEntry>::iterator i,first = file_list.end();
+	map<UDF_Uint64,UDF_Uint64>::iterator fi = parent_dir_to_first_file.find(dir_id);
+	list<FileEntry*>::iterator li;
+	int alloc_sz = 40;	/* . and .. */
+
+	if (fi != parent_dir_to_first_file.end()) first = file_list.find(fi->second);
+	for (i=first;i != file_list.end() && i->second.parent == dir_id;i++)
+		alloc_sz += UDF_file_identifier_size(&i->second);
+
+	/* the directory (unless it fits in its File Entry), then the File Entries of everything in it */
+	UDF_Uint64 dir_sectors = directory_sectors(alloc_sz,dir_id == 0);
+	if (dir_sectors) plan_metadata(dir_start,dir_sectors,data_alignment(dir_sectors,NULL));
+	if (dir_id == 0) {
+		/* -bdmv: see bdmv_place_navigation() */
+		list<FileEntry*> nav = bdmv_navigation_files();
+		for (li=nav.begin();li != nav.end();li++) {
+			FileEntry *f = *li;
+			if (dedupe_files && !plan_deduped.insert(f->same_as ? f->same_as : f->id).second) continue;
+			plan_alloc(0,file_data_sectors(f));
+		}
 
-			/* build extents */
-			{
-				UDF_Uint32 s = fex->start - PartitionStart;
-				ssz = fed->InformationLength;
-				while (ssz >= 1048576000) {
-					LSETDWORD(&sad->ExtentLength,1048576000);
-					LSETDWORD(&sad->ExtentPosition,s);
-					sad = (UDF_short_ad*)(((unsigned char*)sad) + 8);
-					s += 1048576000 >> 11;
-					ssz -= 1048576000;
-				}
-				if (ssz > 0) {
-					LSETDWORD(&sad->ExtentLength,((UDF_Uint32)ssz));
-					LSETDWORD(&sad->ExtentPosition,s);
-					sad = (UDF_short_ad*)(((unsigned char*)sad) + 8);
-					s += (ssz + 2047) >> 11;
-					ssz = 0;
-				}
-				if ((s+PartitionStart) != fex->end) {
-					cerr << "BUG: Extent computation ended at " << s << " expected " << fex->end << endl;
-				}
-				if (allocs_needed != ((((unsigned char*)sad) - (sx->content + 176))>>3)) {
-					cerr << "BUG: Miscalculated the number of extents" << endl;
-				}
+		/* -access-trace: see access_trace_place() */
+		UDF_Uint64 total = 0;
+		nav = access_trace_files();
+		for (li=nav.begin();li != nav.end();li++) {
+			FileEntry *f = *li;
+			if (dedupe_files && !plan_deduped.insert(f->same_as ? f->same_as : f->id).second) continue;
+			total += file_data_sectors(f);
+		}
+		if (trace_cav)		plan_trace_sectors = total;
+		else if (total)		plan_alloc(0,total);
+	}
+	for (i=first;i != file_list.end() && i->second.parent == dir_id;i++) {
+		FileEntry *oex = &i->second;
+		if (oex->existing_fe) continue;
+		if (oex->link_id && !plan_linked.insert(oex->link_id).second) continue;
+		plan_metadata(0,1);
+		if (oex->characteristics & 2)		dirs.push_back(oex);
+		else if (file_data_sectors(oex) > 0)	files.push_back(oex);
+	}
+}
+
+/* a directory and everything below it, in the order of UDF_subdirectory() */
+static void plan_directory(UDF_Uint64 dir_id,UDF_Uint64 dir_start) {
+	list<DirectoryTask> stack;
+	list<FileEntry*>::iterator li;
+	list<FileEntry*>::reverse_iterator ri;
+
+	stack.push_back(DirectoryTask(dir_id,dir_start));
+	while (!stack.empty()) {
+		DirectoryTask t(0,0);
+		t.swap(stack.back());
+		stack.pop_back();
+
+		if (t.files_only) {
+			for (li=t.files.begin();li != t.files.end();li++)
+				plan_file_data(*li);
+			continue;
+		}
+
+		list<FileEntry*> dirs;
+		plan_directory_entries(t.dir_id,t.dir_start,dirs,t.files);
+
+		/* subdirectories, then the data of the files (-cluster-metadata: later, see plan_layout()) */
+		if (cluster_metadata) {
+			plan_dirs.splice(plan_dirs.end(),dirs);
+			plan_files.splice(plan_files.end(),t.files);
+			continue;
+		}
+		t.files_only = 1;
+		stack.push_back(DirectoryTask(0,0));
+		stack.back().swap(t);
+		for (ri=dirs.rbegin();ri != dirs.rend();ri++)
+			stack.push_back(DirectoryTask((*ri)->id,0));
+	}
+}
+
+static UDF_Uint64 plan_layout() {
+	map<UDF_Uint64,OutputExtent>::iterator i;
+
+	/* whatever already has its place (-previous, tar in place) */
+	plan_extents.clear();
+	plan_deduped.clear();
+	plan_linked.clear();
+	plan_trace_sectors = 0;
+	plan_solid = output_extents_solid;
+	for (i=output_extents.begin();i != output_extents.end();i++)
+		plan_extents[i->first] = i->second.end;
+
+	if (append_session) {
+		plan_extents[0] = 16;
+		plan_extents[16] = source_img.sectors;
+	}
+	else {
+		plan_alloc(16,1);	/* BEA01 */
+		plan_alloc(17,1);	/* NSR02 */
+		plan_alloc(18,1);	/* TEA01 */
+	}
+	plan_alloc(0,1);		/* bragging rights */
+	UDF_Uint64 vds = plan_alloc(0,6);
+#ifdef EMIT_RESERVE_VOLUME_DESCRIPTOR
+	plan_alloc(0,6);
+	UDF_Uint64 fileset = vds + 12 + 2;
+#else
+	UDF_Uint64 fileset = vds + 6 + 2;
+#endif
+	UDF_Uint64 metadata_size = 0;
+	if (udf_revision >= 0x0250) {
+		metadata_size = metadata_align(metadata_sectors());
+		plan_metadata_next = metadata_fit(plan_extents,fileset+1,metadata_size);
+		plan_metadata_end = plan_metadata_next + metadata_size;
+		plan_alloc(plan_metadata_next,metadata_size);
+		plan_alloc(fileset,1);	/* the metadata file's File Entry */
+		fileset = plan_metadata_next;
+	}
+	plan_alloc(0,2);		/* Logical Volume Integrity Descriptor */
+	if (!append_session) plan_alloc(256,1);
+	plan_metadata(fileset,1);	/* File Set Descriptor */
+	plan_metadata(fileset+1,1);	/* terminator */
+	plan_metadata(fileset+2,1);	/* root File Entry */
+	plan_directory(0,fileset+3);
+	while (!plan_dirs.empty()) {
+		FileEntry *d = plan_dirs.front();
+		plan_dirs.pop_front();
+		plan_directory(d->id,0);
+	}
+	while (!plan_files.empty()) {
+		plan_file_data(plan_files.front());
+		plan_files.pop_front();
+	}
+	if (plan_trace_sectors) {
+		/* -cav: the layout puts the run here from the start, everything else fits in front of it */
+		trace_tail_start = plan_extents.rbegin()->second;
+		if (layer_break && trace_tail_start < layer_break && (trace_tail_start + plan_trace_sectors) > layer_break)
+			trace_tail_start = layer_break;
+		plan_alloc(trace_tail_start,plan_trace_sectors);
+	}
+	if (metadata_size) {
+		plan_alloc(0,1);	/* the mirror's File Entry */
+		plan_alloc(metadata_align(plan_extents.rbegin()->second),metadata_size);
+	}
+
+	UDF_Uint64 highest = plan_extents.rbegin()->second;
+	plan_extents.clear();
+	return highest;
+}
+
+/* -span: one scan, as many volumes as it takes. The files are packed first fit decreasing: the
+ * largest first, each into the first volume it still fits on. What fits is worked out exactly: a
+ * volume keeps the FID bytes of every directory on it, so a file costs its File Entry, its data
+ * and whatever its FID adds to its directory, plus the File Entry and directory of each parent
+ * that isn't on that volume yet. The first fit layout can still leave a gap below the anchor,
+ * so every volume is then checked with the size planner, and files that don't make it move on.
+ * Each volume is then built by a child process that keeps its own part of the scan. */
+class SpanVolume {
+	public:
+		SpanVolume() {
+			sectors = PLAN_FIXED_SECTORS + 1;	/* and the root directory */
+			dir_bytes[0] = 40;
+		}
+	public:
+		UDF_Uint64		sectors;
+		map<UDF_Uint64,int>	dir_bytes;	/* directories on the volume -> their FID bytes so far */
+		set<UDF_Uint64>		contents;	/* -dedupe: the data already on the volume (first file's id) */
+		set<UDF_Uint64>		links;		/* hard links that have their File Entry on the volume */
+		list<FileEntry*>	entries;	/* in the order they were packed */
+};
+
+static map<UDF_Uint64,FileEntry>	span_entries;		/* everything scanned, file_list is one volume of it */
+static vector<SpanVolume>		span_volumes;
+
+/* the sectors entry e adds to a volume, and if commit, add it */
+static UDF_Uint64 span_add(SpanVolume &vol,FileEntry *e,int commit) {
+	if ((e->characteristics & 2) && vol.dir_bytes.find(e->id) != vol.dir_bytes.end())
+		return 0;
+
+	/* a duplicate (-dedupe) of something already there shares its data */
+	UDF_Uint64 content = e->same_as ? e->same_as : e->id;
+	UDF_Uint64 cost = 1 + file_aed_sectors(e) +
+		((dedupe_files && vol.contents.find(content) != vol.contents.end()) ? 0 : file_data_sectors(e));
+	if (commit && dedupe_files) vol.contents.insert(content);
+
+	/* another link to a file on the volume is only a FID */
+	if (e->link_id && vol.links.find(e->link_id) != vol.links.end())
+		cost = 0;
+	else if (commit && e->link_id)
+		vol.links.insert(e->link_id);
+	if (e->characteristics & 2) {
+		cost += directory_sectors(40,0);
+		if (commit) vol.dir_bytes[e->id] = 40;
+	}
+
+	int b = UDF_file_identifier_size(e);
+	UDF_Uint64 d = e->parent;
+	while (1) {
+		map<UDF_Uint64,int>::iterator i = vol.dir_bytes.find(d);
+		if (i != vol.dir_bytes.end()) {
+			cost += directory_sectors(i->second + b,d == 0) - directory_sectors(i->second,d == 0);
+			if (commit) i->second += b;
+			break;
+		}
+
+		/* the directory isn't on this volume yet */
+		FileEntry *p = &span_entries[d];
+		cost += 1 + directory_sectors(40 + b,0);
+		if (commit) vol.dir_bytes[d] = 40 + b;
+		b = UDF_file_identifier_size(p);
+		d = p->parent;
+	}
+
+	if (commit) {
+		vol.sectors += cost;
+		vol.entries.push_back(e);
+	}
+	return cost;
+}
+
+static int span_fits(SpanVolume &vol,UDF_Uint64 cost) {
+	UDF_Uint64 s = vol.sectors + cost;
+	if (s >= 256) s++;
+	return (s << 11ULL) <= span_capacity;
+}
+
+/* make file_list volume v of span_entries: its files, and the directories they are in */
+static void span_select(UDF_Uint32 v) {
+	map<UDF_Uint64,FileEntry>::reverse_iterator ri;
+	map<UDF_Uint64,FileEntry>::iterator i;
+	set<UDF_Uint64> keep;
+
+	/* children always come after their parent */
+	for (ri=span_entries.rbegin();ri != span_entries.rend();ri++) {
+		FileEntry *f = &ri->second;
+		if (f->volume != v && keep.find(f->id) == keep.end()) continue;
+		keep.insert(f->id);
+		keep.insert(f->parent);
+	}
+
+	file_list.clear();
+	parent_dir_to_first_file.clear();
+	file_list_total = 0;
+	for (i=span_entries.begin();i != span_entries.end();i++) {
+		if (keep.find(i->first) == keep.end()) continue;
+		if (parent_dir_to_first_file.find(i->second.parent) == parent_dir_to_first_file.end())
+			parent_dir_to_first_file[i->second.parent] = i->first;
+		file_list[i->first] = i->second;
+		if (!(i->second.characteristics & 2)) file_list_total += i->second.file_size;
+	}
+}
+
+static bool span_larger(const FileEntry *a,const FileEntry *b) {
+	return file_data_sectors(a) > file_data_sectors(b);
+}
+
+/* first fit, among the volumes from the first'th on */
+static int span_place(FileEntry *f,size_t first) {
+	size_t v;
+	for (v=first;v < span_volumes.size();v++)
+		if (span_fits(span_volumes[v],span_add(span_volumes[v],f,0)))
+			break;
+
+	if (v == span_volumes.size()) {
+		span_volumes.push_back(SpanVolume());
+		if (!span_fits(span_volumes[v],span_add(span_volumes[v],f,0))) {
+			cerr << "ERROR: " << f->abspath << " doesn't fit on a volume of " << humanize(span_capacity) << endl;
+			return 0;
+		}
+	}
+
+	span_add(span_volumes[v],f,1);
+	f->volume = v + 1;
+	return 1;
+}
+
+static int span_pack() {
+	map<UDF_Uint64,FileEntry>::iterator i;
+	map<UDF_Uint64,FileEntry>::reverse_iterator ri;
+	vector<FileEntry*> files;
+	set<UDF_Uint64> has_files;
+	size_t v,fi;
+
+	span_volumes.clear();
+	span_volumes.push_back(SpanVolume());
+
+	for (ri=span_entries.rbegin();ri != span_entries.rend();ri++)
+		if (!(ri->second.characteristics & 2) || has_files.find(ri->first) != has_files.end())
+			has_files.insert(ri->second.parent);
+
+	for (i=span_entries.begin();i != span_entries.end();i++) {
+		FileEntry *f = &i->second;
+		f->volume = 0;
+		if (!(f->characteristics & 2))
+			files.push_back(f);
+		else if (has_files.find(f->id) == has_files.end()) {
+			/* nothing to split up below this one */
+			span_add(span_volumes[0],f,1);
+			f->volume = 1;
+		}
+	}
+
+	stable_sort(files.begin(),files.end(),span_larger);
+	for (fi=0;fi < files.size();fi++)
+		if (!span_place(files[fi],0))
+			return 0;
+
+	/* now exactly. the last file packed on a volume is its smallest, that one moves on */
+	for (v=0;v < span_volumes.size();v++) {
+		span_select(v+1);
+		while ((plan_layout() << 11ULL) > span_capacity) {
+			list<FileEntry*>::reverse_iterator li = span_volumes[v].entries.rbegin();
+			while (li != span_volumes[v].entries.rend() && ((*li)->characteristics & 2)) li++;
+			if (li == span_volumes[v].entries.rend()) {
+				cerr << "ERROR: The directories alone don't fit on a volume of " << humanize(span_capacity) << endl;
+				return 0;
+			}
+
+			FileEntry *moved = *li;
+			list<FileEntry*>::reverse_iterator other = li;
+			for (other++;other != span_volumes[v].entries.rend() && ((*other)->characteristics & 2);other++);
+			if (other == span_volumes[v].entries.rend()) {
+				/* it's the only file on the volume, moving it on doesn't help */
+				cerr << "ERROR: " << moved->abspath << " doesn't fit on a volume of " << humanize(span_capacity) << endl;
+				return 0;
 			}
 
-			fex->setFile(file);
-			SET_UDF_tag_checksum(fed->DescriptorTag,2);
+			list<FileEntry*> rest = span_volumes[v].entries;
+			rest.remove(moved);
+			span_volumes[v] = SpanVolume();
+			for (list<FileEntry*>::iterator ri2=rest.begin();ri2 != rest.end();ri2++)
+				span_add(span_volumes[v],*ri2,1);
+
+			if (!span_place(moved,v+1))
+				return 0;
+			span_select(v+1);
+		}
+	}
+
+	return 1;
+}
+
+/* name.iso -> name_<v>.iso */
+static string span_name(const string &path,UDF_Uint32 v) {
+	char tmp[16];
+	sprintf(tmp,"_%u",v);
+
+	size_t slash = path.rfind('/');
+	size_t dot = path.rfind('.');
+	if (dot == string::npos || (slash != string::npos && dot < slash))
+		return path + string(tmp);
+
+	return path.substr(0,dot) + string(tmp) + path.substr(dot);
+}
+
+/* create (or open, see -resume and -append) the ISO file, and take the volume label from its name */
+static int open_iso_file() {
+	/* remastering an image onto itself would truncate it before it is read */
+	if (source_image != "" || previous_image != "") {
+		struct stat64 a,b,c;
+		if (stat64(iso_file.c_str(),&b) == 0 &&
+			((stat64(source_image.c_str(),&a) == 0 && a.st_dev == b.st_dev && a.st_ino == b.st_ino) ||
+			 (stat64(previous_image.c_str(),&c) == 0 && c.st_dev == b.st_dev && c.st_ino == b.st_ino))) {
+			cerr << "The output ISO cannot be the image it is made from" << endl;
+			return 0;
+		}
+	}
+
+	if (checkpoint_interval > 0)
+		journal_path = iso_file + string(".journal");
+
+	/* default behavior is to NOT overwrite the existing file, unless forced */
+	if (print_size) {
+		/* nothing is written, the ISO isn't even created */
+	}
+	else if (resume_build) {
+		if (!journal_load())
+			return 0;
+		UDF_timestamp_set(volume_recordtime,build_time);
+		iso_fd = open64(iso_file.c_str(),O_RDWR);
+	}
+	else if (append_session) {
+		iso_fd = open64(iso_file.c_str(),O_RDWR);
+	}
+	else if (iso_overwrite)
+		iso_fd = open64(iso_file.c_str(),O_RDWR | O_CREAT | O_TRUNC,0644);
+	else
+		iso_fd = open64(iso_file.c_str(),O_RDWR | O_CREAT | O_EXCL,0644);
+
+	if (iso_fd < 0) {
+		cerr << "Cannot create ISO file " << strerror(errno) << endl;
+		return 0;
+	}
+
+	/* a new, empty file reads back zeros where nothing was written. not so a file the previous
+	 * ISO is cloned into, or one that is resumed or appended to */
+	{
+		struct stat64 st;
+		iso_holes = !print_size && !resume_build && !append_session && previous_image == "" &&
+			fstat64(iso_fd,&st) == 0 && S_ISREG(st.st_mode);
+	}
+
+	if (volume_label == "" && !append_session) {
+		const char *c = strrchr(iso_file.c_str(),'/');
+		if (c) c++;
+		else c = iso_file.c_str();
+
+		int l = strlen(c);
+		if (l > 32) l = 32;
+
+		{
+			const char *d = strrchr(c,'.');
+			if (d) {
+				int p = (int)(d-c);
+				if (l > p) l = p;
+			}
 		}
-		file_ents.clear();
+
+		if (l > 0)
+			volume_label = string(c,l);
 	}
+
+	return 1;
 }
 
 int main(int argc,char **argv) {
@@ -806,69 +4986,217 @@ int main(int argc,char **argv) {
 				cerr << "Cannot get cwd" << endl;
 				return 1;
 			}
-			int rd = readlink(tmp,path,4095);
-			if (rd < 0) rd = 0;
-			path[rd] = 0;
-			close(fd);
+			int rd = readlink(tmp,path,4095);
+			if (rd < 0) rd = 0;
+			path[rd] = 0;
+			close(fd);
+		}
+		invoked_root = path;
+#endif
+	}
+
+	if (!parse_args(argc,argv))
+		return 1;
+
+	/* CRC self-check */
+	{
+		unsigned char test[] = { 0x70, 0x6A, 0x77 };
+		if (!osta_cksum_init() || osta_cksum(test,sizeof(test)) != 0x3299) {
+			cerr << "CRC self-test failure" << endl;
+			return 1;
+		}
+	}
+
+	/* important checks that GCC may miss */
+	assert(sizeof(UDF_lb_addr) == 6);
+
+	if (patch_target != "")
+		return patch_image(patch_target.c_str()) ? 0 : 1;
+
+	srand(time(NULL) + (getpid() * 7729));
+	build_time = time(NULL);
+	UDF_timestamp_set(volume_recordtime,build_time);
+
+	/* the ISO file is created before the scan, the tar input spools data straight into it.
+	 * -span creates one per volume, later */
+	if (iso_file != "" && span_capacity == 0 && !open_iso_file())
+		return 1;
+
+	if (isatty(1))
+		printf("Scanning directory...\n");
+
+	if (tar_source != "") {
+		if (!scan_tar_stream(tar_source.c_str())) return 1;
+	}
+	else if (source_image != "") {
+		if (!scan_source_image(source_image.c_str())) return 1;
+	}
+	else if (append_session) {
+		if (!scan_source_image(iso_file.c_str())) return 1;
+		if (source_img.meta_ref >= 0) {
+			fprintf(stderr,"%s has a metadata partition (UDF 2.50), -append can't add a session to it\n",iso_file.c_str());
+			return 1;
+		}
+	}
+	else if (scan_contents(content_root.c_str()) < 0) return 1;
+
+	if (isatty(1))
+		cout << "* Raw total: " << humanize(file_list_total) << endl;
+
+	if (iso_size_limit && file_list_total > iso_size_limit && !dedupe_files && !auto_sparse_detect) {
+		cerr << "ERROR: The sum of all your files exceed the ISO limit you specified" << endl;
+		return 1;
+	}
+
+	if (bdmv_mode)
+		bdmv_check();
+	if (access_trace != "" && !load_access_trace(access_trace.c_str()))
+		return 1;
+
+	/* runs of zeros that don't have to be stored */
+	if (auto_sparse_detect && !sparse_detect())
+		return 1;
+
+	/* files with the same contents share their data */
+	if (dedupe_files && !dedupe())
+		return 1;
+
+	/* -span: pack, then build the volumes one after another. each one is built by a child that
+	 * keeps its own files of the scan and goes on from here as if that were all there was */
+	if (span_capacity) {
+		span_entries.swap(file_list);
+		if (!span_pack())
+			return 1;
+
+		volume_sequence_max = span_volumes.size();
+		if (volume_set_identifier == "") {
+			/* UDF 2.2.2.5: unique, starting with a time in hex */
+			char tmp[32];
+			sprintf(tmp,"%08lX%08X",(unsigned long)build_time,(unsigned int)rand());
+			volume_set_identifier = tmp;
+		}
+
+		string base_iso = iso_file,base_report = report_file,base_hashes = hashtable_file,base_gaps = gap_file;
+		string base_label = volume_label;
+		UDF_Uint32 v;
+		for (v=1;v <= volume_sequence_max;v++) {
+			if (print_size) {
+				span_select(v);
+				UDF_Uint64 sectors = plan_layout();
+				printf("volume %u: %Lu bytes, %Lu sectors\n",v,sectors << 11ULL,sectors);
+				continue;
+			}
+
+			cout.flush();
+			cerr.flush();
+			fflush(stdout);
+			pid_t pid = fork();
+			if (pid < 0) {
+				cerr << "Cannot start building volume " << v << ": " << strerror(errno) << endl;
+				return 1;
+			}
+			if (pid == 0) {
+				volume_sequence = v;
+				iso_file = span_name(base_iso,v);
+				if (base_report != "") report_file = span_name(base_report,v);
+				if (base_hashes != "") hashtable_file = span_name(base_hashes,v);
+				if (base_gaps != "") gap_file = span_name(base_gaps,v);
+				if (base_label != "") {
+					char tmp[16];
+					sprintf(tmp,"_%u",v);
+					volume_label = base_label.substr(0,30 - strlen(tmp)) + string(tmp);
+				}
+				iso_size_limit = span_capacity;
+				span_select(v);
+				cerr << "Volume " << v << " of " << volume_sequence_max << ": " << iso_file << ", " <<
+					file_list.size() << " entries" << endl;
+				if (!open_iso_file())
+					return 1;
+				break;
+			}
+
+			int status;
+			if (waitpid(pid,&status,0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+				cerr << "ERROR: Volume " << v << " failed" << endl;
+				return 1;
+			}
+		}
+
+		if (v > volume_sequence_max) {
+			if (!print_size)
+				cerr << "Volume set " << volume_set_identifier << " complete, " << volume_sequence_max << " volumes" << endl;
+			return 0;
 		}
-		invoked_root = path;
-#endif
 	}
 
-	if (!parse_args(argc,argv))
+	/* unchanged files claim their old sectors before anything else is placed */
+	if (previous_image != "" && !apply_previous_layout())
 		return 1;
 
-	/* CRC self-check */
+	/* hard links: every link gets a FID, the first one laid out the File Entry they share */
 	{
-		unsigned char test[] = { 0x70, 0x6A, 0x77 };
-		if (osta_cksum(test,sizeof(test)) != 0x3299) {
-			cerr << "CRC self-test failure" << endl;
-			return 1;
+		map<UDF_Uint64,FileEntry>::iterator i;
+		UDF_Uint64 links = 0;
+		for (i=file_list.begin();i != file_list.end();i++) {
+			if (!i->second.link_id) continue;
+			list<FileEntry*> &l = link_members[i->second.link_id];
+			if (l.size() > 0) links++;
+			l.push_back(&i->second);
 		}
+		if (links > 0 && isatty(1))
+			cout << "* " << links << " hard links share the File Entry of the file they link to" << endl;
 	}
 
-	/* important checks that GCC may miss */
-	assert(sizeof(UDF_lb_addr) == 6);
-
-	srand(time(NULL) + (getpid() * 7729));
-	UDF_timestamp_set(volume_recordtime,time(NULL));
-
-	if (isatty(1))
-		printf("Scanning directory...\n");
-
-	if (scan_contents(content_root.c_str()) < 0) return 1;
-
-	if (isatty(1))
-		cout << "* Raw total: " << humanize(file_list_total) << endl;
-
-	if (iso_size_limit && file_list_total > iso_size_limit) {
-		cerr << "ERROR: The sum of all your files exceed the ISO limit you specified" << endl;
+	/* how big it's going to be, exactly */
+	UDF_Uint64 planned_sectors = plan_layout();
+	if (print_size) {
+		printf("%Lu bytes, %Lu sectors\n",planned_sectors << 11ULL,planned_sectors);
+		return 0;
+	}
+	if (iso_size_limit && (planned_sectors << 11ULL) > iso_size_limit) {
+		cerr << "ERROR: The ISO would be " << humanize(planned_sectors << 11ULL) <<
+			", which exceeds the limit you specified" << endl;
 		return 1;
 	}
 
-	OutputExtent *BEA01 = NewOutputExtent(16); {
-		UDF_volumedescriptor_BEA i; assert(sizeof(i) == 2048);
-		memset(&i,0,sizeof(i)); memcpy(i.StandardIdentifier,"BEA01",5);
-		i.VolumeDescriptorVersion = 1; BEA01->setContent(&i,32);
-	}
-	OutputExtent *NSR02 = NewOutputExtent(17); {
-		UDF_volumedescriptor_NSR i; assert(sizeof(i) == 2048);
-		memset(&i,0,sizeof(i)); memcpy(i.StandardIdentifier,"NSR02",5);
-		i.VolumeDescriptorVersion = 1; NSR02->setContent(&i,32);
+	/* appending a session: everything already in the ISO stays where it is and is not written again.
+	 * the new session goes after it and keeps the partition, so that the new directories can refer
+	 * to the File Entries of the files already there. only the anchor at 256 changes, last of all */
+	if (append_session) {
+		if (volume_label == "") volume_label = source_img.volume_id;
+		PartitionStart = source_img.partition_start;
+
+		output_extents[0].setRange(0,16);
+		output_extents[0].prewritten = 1;
+		output_extents[16].setRange(16,source_img.sectors - 16);
+		output_extents[16].prewritten = 1;
 	}
-	OutputExtent *TEA01 = NewOutputExtent(18); {
-		UDF_volumedescriptor_BEA i; assert(sizeof(i) == 2048);
-		memset(&i,0,sizeof(i)); memcpy(i.StandardIdentifier,"TEA01",5);
-		i.VolumeDescriptorVersion = 1; TEA01->setContent(&i,32);
+	else {
+		OutputExtent *BEA01 = NewOutputExtent(16); {
+			UDF_volumedescriptor_BEA i; assert(sizeof(i) == 2048);
+			memset(&i,0,sizeof(i)); memcpy(i.StandardIdentifier,"BEA01",5);
+			i.VolumeDescriptorVersion = 1; BEA01->setContent(&i,32);
+		}
+		OutputExtent *NSR02 = NewOutputExtent(17); {
+			UDF_volumedescriptor_NSR i; assert(sizeof(i) == 2048);
+			memset(&i,0,sizeof(i)); memcpy(i.StandardIdentifier,udf_revision >= 0x0250 ? VOLUME_NSR03 : VOLUME_NSR02,5);
+			i.VolumeDescriptorVersion = 1; NSR02->setContent(&i,32);
+		}
+		OutputExtent *TEA01 = NewOutputExtent(18); {
+			UDF_volumedescriptor_BEA i; assert(sizeof(i) == 2048);
+			memset(&i,0,sizeof(i)); memcpy(i.StandardIdentifier,"TEA01",5);
+			i.VolumeDescriptorVersion = 1; TEA01->setContent(&i,32);
+		}
 	}
 	/* mkisofs does this, why not us too? :) */
 	OutputExtent *BraggingRights = NewOutputExtent(); {
 		unsigned char data[2048];
 		memset(data,0,2048);
-		time_t t = time(NULL);
+		time_t t = build_time;
 		snprintf((char*)data,2047,
 			"mkudfiso v0.2 UDF authoring tool (C) 2007, 2008 Impact Studio Pro. \"%s\" -> \"%s\" on %s",
-			content_root.c_str(),
+			tar_source != "" ? (string("tar:") + tar_source).c_str() :
+				(source_image != "" ? (string("image:") + source_image).c_str() : content_root.c_str()),
 			iso_file.length() > 0 ? iso_file.c_str() : "(stdout)",
 			ctime(&t));
 
@@ -898,6 +5226,7 @@ int main(int argc,char **argv) {
 	OutputExtent *VolumeDescriptorSequenceExtent = NewOutputExtent(0,6); {
 		unsigned char data[2048*6];
 		memset(data,0,sizeof(data));
+		char suffix[4];
 
 		{
 			// <here> + how many sectors we will occupy + 2 sectors for Logical Volume Integrity descriptor
@@ -906,10 +5235,23 @@ int main(int argc,char **argv) {
 #else
 			const UDF_Uint32 begin = VolumeDescriptorSequenceExtent->start + 6 + 2;
 #endif
-			rootfileset_n = begin+0;
-			rootterm_n = begin+1;
-			rootfileent_n = begin+2;
-			rootdir_n = begin+3;
+			if (!append_session) PartitionStart = begin;
+
+			/* -udf-rev 2.50: the metadata file's File Entry starts the partition, the metadata partition
+			 * with the File Set Descriptor, the root and everything else goes wherever it fits */
+			if (udf_revision >= 0x0250) {
+				UDF_Uint64 size = metadata_align(metadata_sectors());
+				metadata_start = metadata_next = metadata_fit(output_extents,begin+1,size);
+				metadata_end = metadata_start + size;
+				NewOutputExtent(metadata_start,size);
+				UDF_metadata_file_entry(NewOutputExtent(begin),250,metadata_start);
+				cerr << "Metadata partition @ " << metadata_start << "-" << (metadata_end-1) << endl;
+			}
+
+			rootfileset_n = metadata_end ? metadata_start : begin;
+			rootterm_n = rootfileset_n+1;
+			rootfileent_n = rootfileset_n+2;
+			rootdir_n = rootfileset_n+3;
 
 			cerr << "Root fileset @ " << rootfileset_n << endl;
 			cerr << "Root terminator @ " << rootterm_n << endl;
@@ -922,15 +5264,15 @@ int main(int argc,char **argv) {
 		UDF_tag_primary_volume_descriptor *primary =
 			(UDF_tag_primary_volume_descriptor*)(data + 2048*0);
 		SET_UDF_tag(primary->DescriptorTag,UDFtag_PrimaryVolumeDescriptor,
-			VolumeDescriptorSequenceExtent->start + 0);
+			VolumeDescriptorSequenceExtent->start + 0,DESCRIPTOR_VERSION);
 		UPDATE_UDF_tag(primary->DescriptorTag);
 		LSETDWORD(&primary->VolumeDescriptorSequenceNumber,0);
 		LSETDWORD(&primary->PrimaryVolumeDescriptorNumber,0);
 		UDF_dstring_strncpy(primary->VolumeIdentifier,
 			sizeof(primary->VolumeIdentifier),
 			volume_label.c_str());
-		LSETDWORD(&primary->VolumeSequenceNumber,1);
-		LSETDWORD(&primary->MaximumVolumeSequenceNumber,1);
+		LSETDWORD(&primary->VolumeSequenceNumber,volume_sequence);
+		LSETDWORD(&primary->MaximumVolumeSequenceNumber,volume_sequence_max);
 		LSETWORD(&primary->InterchangeLevel,3);
 		LSETWORD(&primary->MaximumInterchangeLevel,3);
 		LSETDWORD(&primary->CharacterSetList,1);
@@ -945,7 +5287,7 @@ int main(int argc,char **argv) {
 		SET_UDF_extent_ad(primary->VolumeAbstract,0,0);
 		SET_UDF_extent_ad(primary->VolumeCopyrightNotice,0,0);
 		SET_UDF_regid(primary->ApplicationIdentifier,0,"*mkudfiso","");
-		UDF_timestamp_set(primary->RecordingDateAndTime,time(NULL));
+		UDF_timestamp_set(primary->RecordingDateAndTime,build_time);
 		SET_UDF_regid(primary->ImplementationIdentifier,0,"*mkudfiso","");
 		SET_UDF_tag_checksum(primary->DescriptorTag,2);
 		{
@@ -957,16 +5299,16 @@ int main(int argc,char **argv) {
 		UDF_tag_implementation_use_volume_descriptor *impl2 =
 			(UDF_tag_implementation_use_volume_descriptor*)(data + 2048*1);
 		SET_UDF_tag(impl2->DescriptorTag,UDFtag_ImplementationUseVolumeDescriptor,
-			VolumeDescriptorSequenceExtent->start + 1);
+			VolumeDescriptorSequenceExtent->start + 1,DESCRIPTOR_VERSION);
 		UPDATE_UDF_tag(impl2->DescriptorTag);
 		LSETDWORD(&impl2->VolumeDescriptorSequenceNumber,1);
-		SET_UDF_regid(impl2->ImplementationIdentifier,0,"*UDF LV Info","\x02\x01\x05");
+		SET_UDF_regid(impl2->ImplementationIdentifier,0,"*UDF LV Info",UDF_suffix(suffix,5));
 		{
 			UDF_charspec* t1 = (UDF_charspec*)(((unsigned char*)impl2) + 52);
 			t1->CharacterSetType = 0;
 			strcpy((char*)t1->CharacterSetInformation,"OSTA Compressed Unicode");
 
-			UDF_dstring_strncpy((((unsigned char*)impl2) + 116),84,volume_label.c_str());
+			UDF_dstring_strncpy((((unsigned char*)impl2) + 116),128,volume_label.c_str());	/* LogicalVolumeIdentifier, dstring[128] */
 		}
 		SET_UDF_tag_checksum(impl2->DescriptorTag,2);
 		{
@@ -977,14 +5319,14 @@ int main(int argc,char **argv) {
 		UDF_tag_partition_descriptor *partition =
 			(UDF_tag_partition_descriptor*)(data + 2048*2);
 		SET_UDF_tag(partition->DescriptorTag,UDFtag_PartitionDescriptor,
-			VolumeDescriptorSequenceExtent->start + 2);
+			VolumeDescriptorSequenceExtent->start + 2,DESCRIPTOR_VERSION);
 		UPDATE_UDF_tag(partition->DescriptorTag);
 		LSETDWORD(&partition->VolumeDescriptorSequenceNumber,2);
 		LSETWORD(&partition->PartitionFlags,1);
 		LSETWORD(&partition->PartitionNumber,0);
-		SET_UDF_regid(partition->PartitionContents,0x02,"+NSR02","");
+		SET_UDF_regid(partition->PartitionContents,0x02,metadata_end ? "+NSR03" : "+NSR02","");
 		LSETDWORD(&partition->AccessType,1);
-		LSETDWORD(&partition->PartitionStartingLocation,(PartitionStart = rootfileset_n));
+		LSETDWORD(&partition->PartitionStartingLocation,PartitionStart);
 		LSETDWORD(&partition->PartitionLength,0x7FFFFFFF);	// a guess, this will be updated later
 		SET_UDF_regid(partition->ImplementationIdentifier,0,"*mkudfiso","");
 		SET_UDF_tag_checksum(partition->DescriptorTag,2);
@@ -995,7 +5337,7 @@ int main(int argc,char **argv) {
 		UDF_tag_logical_volume_descriptor *volume =
 			(UDF_tag_logical_volume_descriptor*)(data + 2048*3);
 		SET_UDF_tag(volume->DescriptorTag,UDFtag_LogicalVolumeDescriptor,
-			VolumeDescriptorSequenceExtent->start + 3);
+			VolumeDescriptorSequenceExtent->start + 3,DESCRIPTOR_VERSION);
 		UPDATE_UDF_tag(volume->DescriptorTag);
 		LSETDWORD(&volume->VolumeDescriptorSequenceNumber,3);
 		volume->DescriptorCharacterSet.CharacterSetType = 0;
@@ -1004,12 +5346,14 @@ int main(int argc,char **argv) {
 			sizeof(volume->LogicalVolumeIdentifier),
 			volume_label.c_str());
 		LSETDWORD(&volume->LogicalBlockSize,2048);
-		SET_UDF_regid(volume->DomainIdentifier,0,"*OSTA UDF Compliant","\x02\x01\x03");
-		LSETDWORD((((unsigned char*)volume) + 248),2048);
-		LSETDWORD(&volume->MapTableLength,sizeof(UDF_partition_map_type1));
-		LSETDWORD(&volume->NumberOfPartitionMaps,1);
+		SET_UDF_regid(volume->DomainIdentifier,0,"*OSTA UDF Compliant",UDF_suffix(suffix,3));
+		LSETDWORD((((unsigned char*)volume) + 248),2048);	/* the File Set Descriptor */
+		LSETDWORD((((unsigned char*)volume) + 252),metadata_lbn(rootfileset_n));
+		LSETWORD((((unsigned char*)volume) + 256),METADATA_PARTITION);
+		LSETDWORD(&volume->MapTableLength,sizeof(UDF_partition_map_type1) + (metadata_end ? sizeof(UDF_partition_map_metadata) : 0));
+		LSETDWORD(&volume->NumberOfPartitionMaps,metadata_end ? 2 : 1);
 		LSETDWORD(&volume->IntegritySequenceExtent.length,4096);
-		LSETDWORD(&volume->IntegritySequenceExtent.location,64);
+		LSETDWORD(&volume->IntegritySequenceExtent.location,0);	/* filled in below */
 		SET_UDF_regid(volume->ImplementationIdentifier,0,"*mkudfiso","");
 		UDF_partition_map_type1 *volume_pmt1 =
 			(UDF_partition_map_type1*)(volume->PartitionMaps);
@@ -1017,6 +5361,23 @@ int main(int argc,char **argv) {
 		volume_pmt1->PartitionMapLength = 6;
 		volume_pmt1->VolumeSequenceNumber = 0;
 		volume_pmt1->PartitionNumber = 0;
+		if (metadata_end) {
+			/* partition reference 1, the metadata partition. the mirror's location is filled in
+			 * once it's laid out, after everything else */
+			UDF_partition_map_metadata *volume_pmm =
+				(UDF_partition_map_metadata*)(volume->PartitionMaps + sizeof(UDF_partition_map_type1));
+			volume_pmm->PartitionMapType = 2;
+			volume_pmm->PartitionMapLength = sizeof(UDF_partition_map_metadata);
+			SET_UDF_regid(volume_pmm->PartitionTypeIdentifier,0,"*UDF Metadata Partition",UDF_suffix(suffix,0));
+			volume_pmm->VolumeSequenceNumber = volume_pmt1->VolumeSequenceNumber;
+			volume_pmm->PartitionNumber = 0;
+			volume_pmm->MetadataFileLocation = 0;
+			volume_pmm->MetadataMirrorFileLocation = 0;
+			volume_pmm->MetadataBitmapFileLocation = 0xFFFFFFFF;
+			volume_pmm->AllocationUnitSize = METADATA_UNIT;
+			volume_pmm->AlignmentUnitSize = METADATA_UNIT;
+			volume_pmm->Flags = 1;	/* the mirror is a copy */
+		}
 		SET_UDF_tag_checksum(volume->DescriptorTag,2);
 		{
 			SingleSectorGap s = {512,2047};
@@ -1026,7 +5387,7 @@ int main(int argc,char **argv) {
 		UDF_tag_unallocated_space_descriptor *usd =
 			(UDF_tag_unallocated_space_descriptor*)(data + 2048*4);
 		SET_UDF_tag(usd->DescriptorTag,UDFtag_UnallocatedSpaceDescriptor,
-			VolumeDescriptorSequenceExtent->start + 4);
+			VolumeDescriptorSequenceExtent->start + 4,DESCRIPTOR_VERSION);
 		UPDATE_UDF_tag(usd->DescriptorTag);
 		LSETDWORD(&usd->VolumeDescriptorSequenceNumber,4);
 		LSETDWORD(&usd->NumberOfAllocationDescriptors,0);
@@ -1039,7 +5400,7 @@ int main(int argc,char **argv) {
 		UDF_tag_terminating_descriptor *term =
 			(UDF_tag_terminating_descriptor*)(data + 2048*5);
 		SET_UDF_tag(term->DescriptorTag,UDFtag_TerminatingDescriptor,
-			VolumeDescriptorSequenceExtent->start + 5);
+			VolumeDescriptorSequenceExtent->start + 5,DESCRIPTOR_VERSION);
 		UPDATE_UDF_tag(term->DescriptorTag);
 		SET_UDF_tag_checksum(term->DescriptorTag,2);
 		{
@@ -1071,7 +5432,7 @@ int main(int argc,char **argv) {
 		for (i=0;i < 6;i++) {
 			t = (UDF_tag_terminating_descriptor*)(VolumeDescriptorSequenceExtent2->content + (i*2048));
 			UDF_Uint8 tg = t->DescriptorTag.TagIdentifier;
-			SET_UDF_tag(t->DescriptorTag,tg,VolumeDescriptorSequenceExtent2->start+i);
+			SET_UDF_tag(t->DescriptorTag,tg,VolumeDescriptorSequenceExtent2->start+i,DESCRIPTOR_VERSION);
 			SET_UDF_tag_checksum(t->DescriptorTag,2);
 		}
 	}
@@ -1092,21 +5453,24 @@ int main(int argc,char **argv) {
 		UDF_tag_logical_volume_integrity_descriptor *lv =
 			(UDF_tag_logical_volume_integrity_descriptor*)(data + 2048*0);
 		SET_UDF_tag(lv->DescriptorTag,UDFtag_LogicalVolumeIntegrityDescriptor,
-			LogicalVolumeIntegrity->start);
+			LogicalVolumeIntegrity->start,DESCRIPTOR_VERSION);
 		UPDATE_UDF_tag(lv->DescriptorTag);
-		UDF_timestamp_set(lv->RecordingDateAndTime,time(NULL));
+		UDF_timestamp_set(lv->RecordingDateAndTime,build_time);
 		LSETDWORD(&lv->IntegrityType,1);
-		LSETDWORD(&lv->NumberOfPartitions,1);
+		/* a free space and a size table entry per partition, the implementation use after them */
+		const int partitions = metadata_end ? 2 : 1;
+		LSETDWORD(&lv->NumberOfPartitions,partitions);
 		LSETDWORD(&lv->LengthOfImplementationUse,46);
-		LSETDWORD((((unsigned char*)lv)+84),0x7FFFFFFF);
+		LSETDWORD((((unsigned char*)lv)+80+(partitions*4)),0x7FFFFFFF);
+		if (metadata_end) LSETDWORD((((unsigned char*)lv)+80+(partitions*4)+4),metadata_end - metadata_start);
 		UDF_tag_logical_volume_integrity_descriptor_implementation_use_UDFv102 *iuv102 =
-			(UDF_tag_logical_volume_integrity_descriptor_implementation_use_UDFv102*)(((unsigned char*)lv)+88);
+			(UDF_tag_logical_volume_integrity_descriptor_implementation_use_UDFv102*)(((unsigned char*)lv)+80+(partitions*8));
 		SET_UDF_regid(iuv102->ImplementationID,0,"*mkudfiso","\x05");
 		LSETDWORD(&iuv102->NumberOfFiles,999999999);
 		LSETDWORD(&iuv102->NumberOfDirectories,999999999);
-		LSETWORD(&iuv102->MinimumUDFReadRevision,0x0102);
-		LSETWORD(&iuv102->MinimumUDFWriteRevision,0x0102);
-		LSETWORD(&iuv102->MaximumUDFWriteRevision,0x0102);
+		LSETWORD(&iuv102->MinimumUDFReadRevision,udf_revision);
+		LSETWORD(&iuv102->MinimumUDFWriteRevision,udf_revision);
+		LSETWORD(&iuv102->MaximumUDFWriteRevision,udf_revision);
 		SET_UDF_tag_checksum(lv->DescriptorTag,2);
 		{
 			SingleSectorGap s = {512,2047};
@@ -1115,7 +5479,7 @@ int main(int argc,char **argv) {
 
 		UDF_tag_terminating_descriptor *term =
 			(UDF_tag_terminating_descriptor*)(data + 2048*1);
-		SET_UDF_tag(term->DescriptorTag,UDFtag_TerminatingDescriptor,LogicalVolumeIntegrity->start + 1);
+		SET_UDF_tag(term->DescriptorTag,UDFtag_TerminatingDescriptor,LogicalVolumeIntegrity->start + 1,DESCRIPTOR_VERSION);
 		UPDATE_UDF_tag(term->DescriptorTag);
 		SET_UDF_tag_checksum(term->DescriptorTag,2);
 
@@ -1124,6 +5488,12 @@ int main(int argc,char **argv) {
 			SingleSectorGap s = {16,2047};
 			single_sector_gaps[LogicalVolumeIntegrity->start + 1] = s;
 		}
+
+		/* now the Logical Volume Descriptor can say where this is */
+		UDF_tag_logical_volume_descriptor *volume =
+			(UDF_tag_logical_volume_descriptor*)(VolumeDescriptorSequenceExtent->content + 2048*3);
+		LSETDWORD(&volume->IntegritySequenceExtent.location,LogicalVolumeIntegrity->start);
+		SET_UDF_tag_checksum(volume->DescriptorTag,2);
 	}
 
 #if 0
@@ -1135,11 +5505,12 @@ int main(int argc,char **argv) {
 	}
 #endif
 
-	/* generate anchor */
-	OutputExtent *UDFAnchor1 = NewOutputExtent(256); {
+	/* generate anchor. a new session's anchor replaces the old one after everything else is written */
+	OutputExtent AppendAnchor;
+	OutputExtent *UDFAnchor1 = append_session ? &AppendAnchor : NewOutputExtent(256); {
 		UDF_tag_anchor_volume_descriptor anchor;
 		memset(&anchor,0,sizeof(anchor));
-		SET_UDF_tag(anchor.DescriptorTag,UDFtag_AnchorVolumeDescriptor,256);
+		SET_UDF_tag(anchor.DescriptorTag,UDFtag_AnchorVolumeDescriptor,256,DESCRIPTOR_VERSION);
 		UPDATE_UDF_tag(anchor.DescriptorTag);
 		SET_UDF_extent_ad(anchor.MainVolumeDescriptorSequenceExtent,2048*16,VolumeDescriptorSequenceExtent->start);
 #ifdef EMIT_RESERVE_VOLUME_DESCRIPTOR
@@ -1157,12 +5528,13 @@ int main(int argc,char **argv) {
 	//       I wish ECMA and OSTA would clarify that fact in their standards documents.
 
 	/* root fileset */
-	OutputExtent *RootFileset = NewOutputExtent(rootfileset_n); {
+	OutputExtent *RootFileset = NewMetadataExtent(rootfileset_n); {
 		UDF_tag_file_set_descriptor fset;
+		char suffix[4];
 		memset(&fset,0,sizeof(fset));
-		SET_UDF_tag(fset.DescriptorTag,UDFtag_FileSetDescriptor,rootfileset_n - PartitionStart);
+		SET_UDF_tag(fset.DescriptorTag,UDFtag_FileSetDescriptor,metadata_lbn(rootfileset_n),DESCRIPTOR_VERSION);
 		UPDATE_UDF_tag(fset.DescriptorTag);
-		UDF_timestamp_set(fset.RecordingDateAndTime,time(NULL));
+		UDF_timestamp_set(fset.RecordingDateAndTime,build_time);
 		LSETWORD(&fset.InterchangeLevel,3);
 		LSETWORD(&fset.MaximumInterchangeLevel,3);
 		LSETDWORD(&fset.CharacterSetList,1);
@@ -1186,28 +5558,28 @@ int main(int argc,char **argv) {
 		UDF_dstring_strncpy(fset.AbstractFileIdentifier,
 			sizeof(fset.AbstractFileIdentifier),
 			"");
-		SET_UDF_regid(fset.DomainIdentifier,0,"*OSTA UDF Compliant","\x02\x01\x03");
+		SET_UDF_regid(fset.DomainIdentifier,0,"*OSTA UDF Compliant",UDF_suffix(suffix,3));
 		fset.RootDirectoryICB.ExtentLength = 2048;
-		fset.RootDirectoryICB.ExtentLocation.LogicalBlockNumber = rootfileent_n - PartitionStart;
-		fset.RootDirectoryICB.ExtentLocation.PartitionReferenceNumber = 0;
+		fset.RootDirectoryICB.ExtentLocation.LogicalBlockNumber = metadata_lbn(rootfileent_n);
+		fset.RootDirectoryICB.ExtentLocation.PartitionReferenceNumber = METADATA_PARTITION;
 		SET_UDF_tag_checksum(fset.DescriptorTag,2);
 		/* bytes 480...511 are "reserved" */
 		RootFileset->setContent(&fset,480); // sizeof(fset));
 	}
 	/* terminator */
-	OutputExtent *RootFileTerm = NewOutputExtent(rootterm_n); {
+	OutputExtent *RootFileTerm = NewMetadataExtent(rootterm_n); {
 		UDF_tag_terminating_descriptor t;
 		memset(&t,0,sizeof(t));
-		SET_UDF_tag(t.DescriptorTag,UDFtag_TerminatingDescriptor,RootFileTerm->start);
+		SET_UDF_tag(t.DescriptorTag,UDFtag_TerminatingDescriptor,RootFileTerm->start,DESCRIPTOR_VERSION);
 		UPDATE_UDF_tag(t.DescriptorTag);
 		/* bytes 16...511 are "reserved" */
 		RootFileTerm->setContent(&t,16); // sizeof(t));
 	}
 	/* root file entry */
-	OutputExtent *RootFileEntry = NewOutputExtent(rootfileent_n); {
+	OutputExtent *RootFileEntry = NewMetadataExtent(rootfileent_n); {
 		UDF_tag_file_entry_descriptor fed;
 		memset(&fed,0,sizeof(fed));
-		SET_UDF_tag(fed.DescriptorTag,UDFtag_FileEntry,rootfileent_n - PartitionStart);
+		SET_UDF_tag(fed.DescriptorTag,UDFtag_FileEntry,metadata_lbn(rootfileent_n),DESCRIPTOR_VERSION);
 		UPDATE_UDF_tag(fed.DescriptorTag);
 		fed.ICBTag.FileType = 4;	// directory
 		fed.ICBTag.Flags = 0x0230;	// don't relocate this, use short_ad
@@ -1220,262 +5592,74 @@ int main(int argc,char **argv) {
 		fed.FileLinkCount = 1;
 		fed.InformationLength = 0;// TODO: Length of the root directory
 		fed.LogicalBlocksRecorded = 0;// TODO: Length of the root directory
-		UDF_timestamp_set(fed.AccessDateAndTime,time(NULL));
-		UDF_timestamp_set(fed.ModificationDateAndTime,time(NULL));
-		UDF_timestamp_set(fed.AttributeDateAndTime,time(NULL));
+		UDF_timestamp_set(fed.AccessDateAndTime,build_time);
+		UDF_timestamp_set(fed.ModificationDateAndTime,build_time);
+		UDF_timestamp_set(fed.AttributeDateAndTime,build_time);
 		fed.Checkpoint = 1;
 		SET_UDF_regid(fed.ImplementationIdentifier,0,"*mkudfiso","");
 		fed.UniqueId = 0;
 		fed.LengthOfAllocationDescriptors = sizeof(UDF_short_ad);
 		UDF_short_ad *ex = (UDF_short_ad*)(((unsigned char*)(&fed)) + 176);
 		ex->ExtentLength = 0;// TODO: Length of root directory
-		ex->ExtentPosition = rootdir_n - PartitionStart;
+		ex->ExtentPosition = metadata_lbn(rootdir_n);
 		SET_UDF_tag_checksum(fed.DescriptorTag,2);
 		RootFileEntry->setContent(&fed,sizeof(fed));
 	}
-	UDF_tag_file_entry_descriptor *RootFileEntryTag =
-		(UDF_tag_file_entry_descriptor*)(RootFileEntry->content);
-	UDF_short_ad *RootFileEntryTagExtent =
-		(UDF_short_ad*)(((unsigned char*)(RootFileEntryTag)) + 176);
-
-	/* now generate the root directory */
-	OutputExtent *RootDirectory = NULL; {
-		map<UDF_Uint64,FileEntry>::iterator i;
-		FileEntry *oex = NULL;
-		int alloc_sz = 40;	/* room for . and .. */
-
-/* how much memory/space do we need to create the directory? */
-		for (	i  = file_list.find(parent_dir_to_first_file[0]);
-			i != file_list.end() && i->second.parent == 0;i++) {
-			oex = &i->second;
-			int sz =
-				16 + 2 + 1 + 1 + 16 + 2 +
-				0 + /* Length of Implementation Use */
-				/* null-length Implementation Use */
-				oex->name.length() + 1;	/* File Identifier (as a d-string) */
-			sz = (sz + 3) & (~3);		/* padding (up to next DWORD) */
-			alloc_sz += sz;
-		}
-		if (alloc_sz == 0) {
-			cerr << "ERROR: Program bug: Apparently there is no root directory" << endl;
-			return 1;
-		}
-
-/* create the directory */
-		RootDirectory = NewOutputExtent(rootdir_n,(alloc_sz+2047) >> 11);
-		unsigned char *dir_raw = new unsigned char[alloc_sz];
-		unsigned char *dir_cur = dir_raw;
-		memset(dir_raw,0,alloc_sz);
-
-		/* . and .. */
-		{
-			UDF_tag_file_identifier_descriptor *fent =
-				(UDF_tag_file_identifier_descriptor*)dir_cur;
-			SET_UDF_tag(fent->DescriptorTag,UDFtag_FileIdentifierDescriptor,
-				RootFileEntryTagExtent->ExtentPosition);
-			UPDATE_UDF_tag(fent->DescriptorTag);
-			fent->FileVersionNumber = 1;
-			fent->FileCharacteristics = 0x0A;	/* parent node */
-			fent->LengthOfFileIdentifier = 0;
-			fent->ICB.ExtentLength = 2048;
-			fent->ICB.ExtentLocation.LogicalBlockNumber = rootfileent_n - PartitionStart;	/* ourself */
-			fent->ICB.ExtentLocation.PartitionReferenceNumber = 0;
-			SET_UDF_tag_checksum(fent->DescriptorTag,2);
-			dir_cur += 40;
-		}
-
-		list< pair<UDF_Uint64,FileEntry*> > dir_ents;
-		list< pair<UDF_Uint64,FileEntry*> > file_ents;
-		for (	i  = file_list.find(parent_dir_to_first_file[0]);
-			i != file_list.end() && i->second.parent == 0;i++) {
-			oex = &i->second;
-			int sz =
-				16 + 2 + 1 + 1 + 16 + 2 +
-				0 + /* Length of Implementation Use */
-				/* null-length Implementation Use */
-				oex->name.length() + 1;	/* File Identifier (as a d-string) */
-			sz = (sz + 3) & (~3);		/* padding (up to next DWORD) */
-
-			if ((dir_cur + sz) > (dir_raw + alloc_sz)) {
-				cerr << "ERROR: Program bug: Miscalculation of an entry in the root dir" << endl;
-				return 1;
-			}
-
-			/* TODO: For files larger than 231GB, multiple sectors are needed for the allocation extent array.
-			 *       Note that the current CD/DVD/Bluray/HD-DVD media is not that large, so this is not a concern yet */
-			OutputExtent *FileEntry2 = NewOutputExtent();
-			unsigned char FileEntry2TagRaw[2048];
-			memset(FileEntry2TagRaw,0,sizeof(FileEntry2TagRaw));
-			UDF_tag_file_entry_descriptor &FileEntry2Tag = *((UDF_tag_file_entry_descriptor*)FileEntry2TagRaw);
-			SET_UDF_tag(FileEntry2Tag.DescriptorTag,UDFtag_FileEntry,
-				FileEntry2->start - PartitionStart);
-			UPDATE_UDF_tag(FileEntry2Tag.DescriptorTag);
-			FileEntry2Tag.ICBTag.PriorRecordedNumberOfDirectEntries = 0;
-			FileEntry2Tag.ICBTag.StrategyType = 4;
-			LSETWORD(&FileEntry2Tag.ICBTag.StrategyParameter,0);
-			FileEntry2Tag.ICBTag.MaximumNumberOfEntries = 1;
-			FileEntry2Tag.ICBTag.FileType = (oex->characteristics & 2) ? 4 : 5; /* file or folder? */
-			FileEntry2Tag.ICBTag.ParentICBLocation.LogicalBlockNumber = rootfileent_n - PartitionStart;
-			FileEntry2Tag.ICBTag.ParentICBLocation.PartitionReferenceNumber = 0;
-			FileEntry2Tag.ICBTag.Flags = 0x230;	/* non-relocatable, short_ad */
-			FileEntry2Tag.Uid = -1;
-			FileEntry2Tag.Gid = -1;
-			FileEntry2Tag.Permissions = oex->permissions;
-			FileEntry2Tag.FileLinkCount = 1;
-			FileEntry2Tag.RecordFormat = 0;
-			FileEntry2Tag.RecordDisplayAttributes = 0;
-			FileEntry2Tag.RecordLength = 0;
-			FileEntry2Tag.InformationLength = oex->file_size;
-			FileEntry2Tag.LogicalBlocksRecorded = (oex->file_size + 2047LL) >> 11LL;
-			FileEntry2Tag.AccessDateAndTime = oex->file_atime;
-			FileEntry2Tag.AttributeDateAndTime = oex->file_ctime;
-			FileEntry2Tag.ModificationDateAndTime = oex->file_mtime;
-			FileEntry2Tag.Checkpoint = 1;
-			FileEntry2Tag.UniqueId = oex->id;
-			SET_UDF_regid(FileEntry2Tag.ImplementationIdentifier,0,"*mkudfiso","");
-			/* set aside directories for later */
-			if (oex->characteristics & 2) {
-				/* add to list */
-				pair<UDF_Uint64,FileEntry*> po(FileEntry2->start,&file_list[i->first]);
-				dir_ents.push_back(po);
-			}
-			/* if the file is small enough we can stick the contents directly INTO the descriptor
-			 * where the allocation extents normally go. See ECMA-167 4/14.6 "ICB tag" */
-			else if (FileEntry2Tag.InformationLength < (2048-176)) {
-				FileEntry2Tag.ICBTag.Flags = 0x233;	/* non-relocateable, the allocation extent area IS the file content */
-				FileEntry2Tag.LengthOfAllocationDescriptors = FileEntry2Tag.InformationLength;
-				FileEntry2Tag.LogicalBlocksRecorded = 0;
-
-				if (extra_large_chdir(oex->path.c_str()) < 0) {
-					cerr << "Cannot enter " << oex->path << endl;
-				}
-				else {
-					int fd = open(oex->name.c_str(),O_RDONLY);
-					if (fd < 0) {
-						cerr << "Cannot open " << oex->abspath << endl;
-					}
-					else {
-						int r = read(fd,((unsigned char*)(&FileEntry2Tag))+176,FileEntry2Tag.InformationLength);
-						if (r < FileEntry2Tag.InformationLength)
-							cerr << "WARNING: Read less data than expected for " << oex->abspath << endl;
-						close(fd);
-					}
-				}
-			}
-			else {
-				/* add to list */
-				pair<UDF_Uint64,FileEntry*> po(FileEntry2->start,&file_list[i->first]);
-				file_ents.push_back(po);
-			}
-			SET_UDF_tag_checksum(FileEntry2Tag.DescriptorTag,2);
-			FileEntry2->setContent(&FileEntry2Tag,2048);
-
-			/* create the directory entry */
-			UDF_tag_file_identifier_descriptor *fent =
-				(UDF_tag_file_identifier_descriptor*)dir_cur;
-			SET_UDF_tag(fent->DescriptorTag,UDFtag_FileIdentifierDescriptor,
-				RootFileEntryTagExtent->ExtentPosition);
-			UPDATE_UDF_tag(fent->DescriptorTag);
-			fent->FileVersionNumber = 1;
-			fent->FileCharacteristics = oex->characteristics;
-			fent->LengthOfFileIdentifier = oex->name.length()+1;	/* doesn't count d-string type? */
-			fent->ICB.ExtentLength = 2048;
-			fent->ICB.ExtentLocation.LogicalBlockNumber = FileEntry2->start - PartitionStart;
-			fent->ICB.ExtentLocation.PartitionReferenceNumber = 0;
-			UDF_dstring_strncpyne((dir_cur+38),(oex->name.length()+1),oex->name.c_str());
-			SET_UDF_tag_checksum(fent->DescriptorTag,2);
-
-			/* advance */
-			dir_cur += sz;
-		}
-		RootDirectory->setContent(dir_raw,alloc_sz);
-		delete dir_raw;
-
-		RootFileEntryTag->InformationLength = alloc_sz;
-		RootFileEntryTag->LogicalBlocksRecorded = (alloc_sz + 2047LL) >> 11LL;
-		RootFileEntryTagExtent->ExtentLength = alloc_sz;
-		SET_UDF_tag_checksum(RootFileEntryTag->DescriptorTag,2);
+	/* now generate the root directory, the root is its own parent */
+	UDF_subdirectory((UDF_short_ad*)(RootFileEntry->content + 176),RootFileEntry,0,RootFileEntry);
+
+	/* -cluster-metadata: the rest of the directories, then the data of all the files */
+	while (!cluster_dirs.empty()) {
+		ClusterDir d = cluster_dirs.front();
+		cluster_dirs.pop_front();
+		UDF_subdirectory(d.extent,d.parent,d.dir_id,d.self);
+	}
+	while (!cluster_files.empty()) {
+		OutputExtent *sx = &output_extents[cluster_files.front().first];
+		UDF_file_allocation(cluster_files.front().second,sx);
+		cluster_files.pop_front();
+	}
 
-		pair<UDF_Uint64,FileEntry*> prpair;
-		list< pair<UDF_Uint64,FileEntry*> >::iterator pri;
+	/* every File Entry has its place: the contents of the small files go in theirs */
+	if (!embed_file_heads())
+		return 1;
 
-		/* put folders in */
-		for (pri=dir_ents.begin();pri != dir_ents.end();pri++) {
-			UDF_Uint64 sector = pri->first;
-			FileEntry* file = pri->second;
-			OutputExtent *sx = &output_extents[sector];
-			UDF_subdirectory(RootFileEntryTagExtent,RootDirectory,file->id,sx);
+	/* -udf-rev 2.50: the File Entries become Extended File Entries, and the metadata partition gets
+	 * its mirror after everything else, as far from the original as it gets */
+	if (metadata_end) {
+		map<UDF_Uint64,OutputExtent>::iterator mi;
+		for (mi=output_extents.lower_bound(metadata_start);mi != output_extents.end() && mi->first < metadata_next;mi++) {
+			if (mi->second.content && LGETWORD(mi->second.content) == UDFtag_FileEntry)
+				UDF_extended_file_entry(&mi->second);
 		}
-		dir_ents.clear();
-
-		/* put files in */
-		for (pri=file_ents.begin();pri != file_ents.end();pri++) {
-			UDF_Uint64 sector = pri->first;
-			FileEntry* file = pri->second;
-			OutputExtent *sx = &output_extents[sector];
-			if (!sx->content) {
-				cerr << "Unexpected: Sector " << sector << " does not have contents" << endl;
-				continue;
-			}
-
-			UDF_tag_file_entry_descriptor *fed =
-				(UDF_tag_file_entry_descriptor*)(sx->content);
 
-			int allocs_needed = 1;
-			UDF_Uint64 ssz = fed->InformationLength;
-			UDF_short_ad *sad = (UDF_short_ad*)(sx->content + 176);
+		OutputExtent *MirrorFileEntry = NewOutputExtent();
+		OutputExtent *Mirror = NewOutputExtent(metadata_align(output_extents.rbegin()->second.end),metadata_end - metadata_start);
+		Mirror->mirror_of = metadata_start;
+		UDF_metadata_file_entry(MirrorFileEntry,251,Mirror->start);
+		cerr << "Metadata mirror @ " << Mirror->start << "-" << (Mirror->end-1) << endl;
 
-			/* how many allocation extents */
-			while (ssz >= 1048576000) {
-				ssz -= 1048576000;
-				allocs_needed++;
-			}
-
-			fed->LengthOfAllocationDescriptors =
-				allocs_needed * 8;
-
-			/* make the output extent for the file */
-			OutputExtent *fex = NewOutputExtent(0,fed->LogicalBlocksRecorded);
-
-			/* build extents */
-			{
-				UDF_Uint32 s = fex->start - PartitionStart;
-				ssz = fed->InformationLength;
-				while (ssz >= 1048576000) {
-					LSETDWORD(&sad->ExtentLength,1048576000);
-					LSETDWORD(&sad->ExtentPosition,s);
-					sad = (UDF_short_ad*)(((unsigned char*)sad) + 8);
-					s += 1048576000 >> 11;
-					ssz -= 1048576000;
-				}
-				if (ssz > 0) {
-					LSETDWORD(&sad->ExtentLength,((UDF_Uint32)ssz));
-					LSETDWORD(&sad->ExtentPosition,s);
-					sad = (UDF_short_ad*)(((unsigned char*)sad) + 8);
-					s += (ssz + 2047) >> 11;
-					ssz = 0;
-				}
-				if ((s+PartitionStart) != fex->end) {
-					cerr << "BUG: Extent computation ended at " << s << " expected " << fex->end << endl;
-				}
-				if (allocs_needed != ((((unsigned char*)sad) - (sx->content + 176))>>3)) {
-					cerr << "BUG: Miscalculated the number of extents" << endl;
-				}
-			}
-
-			fex->setFile(file);
-			SET_UDF_tag_checksum(fed->DescriptorTag,sx->content_length-16);
-		}
-		file_ents.clear();
+		UDF_tag_logical_volume_descriptor *volume =
+			(UDF_tag_logical_volume_descriptor*)(VolumeDescriptorSequenceExtent->content + 2048*3);
+		UDF_partition_map_metadata *volume_pmm =
+			(UDF_partition_map_metadata*)(volume->PartitionMaps + sizeof(UDF_partition_map_type1));
+		volume_pmm->MetadataMirrorFileLocation = MirrorFileEntry->start - PartitionStart;
+		SET_UDF_tag_checksum(volume->DescriptorTag,2);
 	}
 
+	/* every File Entry and FID is final now */
+	if (!descriptor_checksums())
+		return 1;
+
 	UDF_Uint64 highest_sector;
 	/* total ISO size? */
 	{
 		map<UDF_Uint64,OutputExtent>::reverse_iterator ri = output_extents.rbegin();
 		highest_sector = ri->second.end;
-		cout << "Total ISO size: " << humanize(highest_sector << 11LL) <<
+		cerr << "Total ISO size: " << humanize(highest_sector << 11LL) <<
 			", or " << highest_sector << " sectors" << endl;
+		if (highest_sector != planned_sectors)
+			cerr << "BUG: The size planner said " << planned_sectors << " sectors" << endl;
 	}
 
 	/* update the partition descriptor */
@@ -1493,41 +5677,6 @@ int main(int argc,char **argv) {
 	unsigned char iso_sha1[20];
 	unsigned char iso_md5[16];
 	UDF_Uint64 iso_sectors = 0;
-	int iso_fd = 1;	// STDOUT by default
-
-	if (iso_file != "") {
-		/* default behavior is to NOT overwrite the existing file, unless forced */
-		if (iso_overwrite)
-			iso_fd = open64(iso_file.c_str(),O_RDWR | O_CREAT | O_TRUNC,0644);
-		else
-			iso_fd = open64(iso_file.c_str(),O_RDWR | O_CREAT | O_EXCL,0644);
-
-		if (iso_fd < 0) {
-			cerr << "Cannot create ISO file " << strerror(errno) << endl;
-			return 1;
-		}
-
-		if (volume_label == "") {
-			const char *c = strrchr(iso_file.c_str(),'/');
-			if (c) c++;
-			else c = iso_file.c_str();
-
-			int l = strlen(c);
-			if (l > 32) l = 32;
-
-			{
-				const char *d = strrchr(c,'.');
-				if (d) {
-					int p = (int)(d-c);
-					if (l > p) l = p;
-				}
-			}
-
-			if (l > 0)
-				volume_label = string(c,l);
-		}
-	}
-
 	/* generate report file, if requested */
 	if (report_file != "") {
 		FILE *rfp = fopen(report_file.c_str(),"wb");
@@ -1536,21 +5685,39 @@ int main(int argc,char **argv) {
 			return 1;
 		}
 
-		time_t t = time(NULL);
+		time_t t = build_time;
 		fprintf(rfp,"mkudfiso report for volume \"%s\" volumeset \"%s\"\n",
 			volume_label.c_str(),
 			volume_set_identifier.c_str());
+		if (layer_break)
+			fprintf(rfp,"Layer break: sector %Lu\n",layer_break);
 		fprintf(rfp,"Generated %s\n",ctime(&t));	/* one empty line: ctime() makes it's own \n */
 
 		{
 			map<UDF_Uint64,OutputExtent>::iterator i = output_extents.begin();
+			int past_break = 0;
 			while (i != output_extents.end()) {
-				if (i->second.file) {
-					fprintf(rfp,"Entry %s\n",i->second.file->name.c_str());
-					fprintf(rfp,"\t" "Absolute path: %s\n",i->second.file->abspath.c_str());
-					fprintf(rfp,"\t" "File size: %Lu\n",i->second.file->file_size);
+				/* the file the extent belongs to, then any others sharing it */
+				FileEntry *f = i->second.file;
+				multimap<UDF_Uint64,FileEntry*>::iterator si = shared_extents.lower_bound(i->first);
+				if (layer_break && !past_break && i->second.start >= layer_break) {
+					fprintf(rfp,"Layer break at sector %Lu\n\n",layer_break);
+					past_break = 1;
+				}
+				while (f) {
+					fprintf(rfp,"Entry %s\n",f->name.c_str());
+					fprintf(rfp,"\t" "Absolute path: %s\n",f->abspath.c_str());
+					fprintf(rfp,"\t" "File size: %Lu\n",f->file_size);
+					fprintf(rfp,"\t" "Modified: %s\n",UDF_timestamp_str(f->file_mtime).c_str());
 					fprintf(rfp,"\t" "Sectors: %Lu-%Lu\n",i->second.start,i->second.end-1LL);
+					if (layer_break && i->second.start < layer_break && i->second.end > layer_break)
+						fprintf(rfp,"\t" "Crosses the layer break\n");
+					map<UDF_Uint64,UDF_Uint64>::iterator hi;
+					for (hi=f->holes.begin();hi != f->holes.end();hi++)
+						fprintf(rfp,"\t" "Zeros (not stored): bytes %Lu-%Lu\n",hi->first,hi->first+hi->second-1ULL);
 					fprintf(rfp,"\n");
+
+					f = (si != shared_extents.end() && si->first == i->first) ? (si++)->second : NULL;
 				}
 
 				i++;
@@ -1588,7 +5755,7 @@ int main(int argc,char **argv) {
 			OutputExtent *rtx = NewOutputExtent();
 			UDF_tag_implementation_use_volume_descriptor ftag;
 			memset(&ftag,0,sizeof(ftag));
-			SET_UDF_tag(ftag.DescriptorTag,UDFtag_ImplementationUseVolumeDescriptor,rtx->start);
+			SET_UDF_tag(ftag.DescriptorTag,UDFtag_ImplementationUseVolumeDescriptor,rtx->start,DESCRIPTOR_VERSION);
 			UPDATE_UDF_tag(ftag.DescriptorTag);
 			LSETDWORD(&ftag.VolumeDescriptorSequenceNumber,1);
 			SET_UDF_regid(ftag.ImplementationIdentifier,1,"*mkudfiso","Report");
@@ -1616,6 +5783,29 @@ int main(int argc,char **argv) {
 			md5_starts(&md5_ctx);
 		}
 
+		/* the journal, and where a resumed build picks up */
+		JournalCheckpoint *resume = NULL;
+		if (journal_path != "") {
+			signed long long first = journal_open(highest_sector);
+			if (first < 0)
+				return 1;
+
+			if (first > 0) {
+				resume = &journal_resume;
+				n = first;
+				iso_sectors = resume->iso_sectors;
+				sha256_ctx = resume->iso_sha256;
+				sha1_ctx = resume->iso_sha1;
+				md5_ctx = resume->iso_md5;
+				lseek64(iso_fd,n << 11ULL,SEEK_SET);
+				while (i != output_extents.end() && i->second.end <= n) i++;
+				cerr << "Resuming at sector " << n << " of " << highest_sector << endl;
+			}
+		}
+
+		if (source_order && !source_order_write(n))
+			return 1;
+
 		while (i != output_extents.end()) {
 			if (n < i->second.start) {
 				memset(sectorbuffer,0,2048);
@@ -1627,8 +5817,14 @@ int main(int argc,char **argv) {
 						iso_sectors++;
 					}
 
-					write(iso_fd,sectorbuffer,2048);
+					if (iso_holes)
+						lseek64(iso_fd,2048,SEEK_CUR);
+					else
+						write(iso_fd,sectorbuffer,2048);
 					n++;
+
+					if (journal_fp && n >= journal_next)
+						journal_checkpoint(n,iso_sectors,&sha256_ctx,&sha1_ctx,&md5_ctx,NULL,0,0);
 				}
 			}
 
@@ -1648,15 +5844,106 @@ int main(int argc,char **argv) {
 					md5_starts(&f->md5_ctx);
 				}
 
-				int in_fd = open64(f->abspath.c_str(),O_RDONLY);
-				if (in_fd >= 0) {
-					UDF_Uint64 cp = 0;
-					lseek64(in_fd,0,SEEK_SET);
+				/* resuming in the middle of this file */
+				UDF_Uint64 cp = 0;
+				if (n > i->second.start && resume) {
+					cp = resume->file_bytes;
+					hash_len = resume->hash_length;
+					f->sha256_ctx = resume->file_sha256;
+					f->sha1_ctx = resume->file_sha1;
+					f->md5_ctx = resume->file_md5;
+				}
+				resume = NULL;
+
+				/* -sparse: the runs of zeros before cp, which aren't in the ISO */
+				UDF_Uint64 skipped = 0;
+				map<UDF_Uint64,UDF_Uint64>::iterator hi;
+				for (hi=f->holes.begin();hi != f->holes.end() && hi->first < cp;hi++)
+					skipped += hi->second;
+
+				/* where the data comes from: the file itself, a spool, or the ISO when it's already there */
+				int in_fd;
+				char in_pread = 1;
+				UDF_Uint64 in_ofs = 0;
+				if (i->second.prewritten) {
+					in_fd = iso_fd;
+					in_ofs = i->second.start << 11ULL;
+				}
+				else if (f->src_fd >= 0) {
+					in_fd = f->src_fd;
+					in_ofs = f->src_offset;
+				}
+				else {
+					in_fd = source_open(f->abspath.c_str());
+					in_pread = 0;
+				}
+
+				int copied;
+				if (i->second.prewritten && !do_hash) {
+					/* nothing to write or hash */
+					n = i->second.end;
+					lseek64(iso_fd,n << 11ULL,SEEK_SET);
+				}
+				else if (in_pread && !do_hash && iso_copy_range && n == i->second.start && f->holes.empty() &&
+					(copied = copy_range(in_fd,in_ofs,iso_fd,n << 11ULL,f->file_size)) != 0) {
+					/* image to image: the kernel copied (or shared) the blocks */
+					if (copied < 0) {
+						fprintf(stderr,"write error: cannot copy %s. %s\n",f->abspath.c_str(),strerror(errno));
+						exit(1);
+					}
+
+					UDF_Uint64 tail = f->file_size & 2047ULL;
+					if (tail) {
+						memset(sectorbuffer,0,2048);
+						pwrite64(iso_fd,sectorbuffer,2048-tail,(n << 11ULL) + f->file_size);
+					}
+					n = i->second.end;
+					lseek64(iso_fd,n << 11ULL,SEEK_SET);
+				}
+				else if (in_fd >= 0) {
+					/* holes in the source aren't read, and where the ISO can have holes too, not written */
+					SourceMap src(in_fd,in_ofs,f->file_size);
+					int zero = 0;
+					if (!in_pread) lseek64(in_fd,cp,SEEK_SET);
 					while (n < i->second.end) {
-						int rd = read(in_fd,sectorbuffer,2048);
+						int rd;
+
+						/* a run of zeros that isn't recorded. only the file's digests see it */
+						if ((hi = f->holes.find(cp)) != f->holes.end()) {
+							if (do_hash) {
+								UDF_Uint64 z;
+								memset(sectorbuffer,0,2048);
+								for (z=0;z < hi->second;z += 2048) {
+									sha256_update(&f->sha256_ctx,sectorbuffer,2048);
+									sha1_update(&f->sha1_ctx,sectorbuffer,2048);
+									md5_update(&f->md5_ctx,sectorbuffer,2048);
+								}
+								hash_len += hi->second;
+							}
+							cp += hi->second;
+							skipped += hi->second;
+							if (!in_pread) lseek64(in_fd,cp,SEEK_SET);
+						}
+
+						if (!i->second.prewritten && (zero = src.zero(cp,2048)) != 0) {
+							UDF_Uint64 rem = f->file_size - cp;
+							rd = (rem < 2048) ? (int)rem : 2048;
+							memset(sectorbuffer,0,2048);
+							if (!in_pread) lseek64(in_fd,cp + rd,SEEK_SET);
+						}
+						else if (in_pread) {
+							UDF_Uint64 rem = f->file_size - cp;
+							rd = (rem == 0) ? 0 : pread64(in_fd,sectorbuffer,(rem < 2048) ? (int)rem : 2048,
+								in_ofs + cp - (i->second.prewritten ? skipped : 0));
+						}
+						else {
+							rd = read(in_fd,sectorbuffer,2048);
+						}
 						if (rd < 0) rd = 0;
 						if (rd < 2048) memset(sectorbuffer+rd,0,2048-rd);
-						if (write(iso_fd,sectorbuffer,2048) < 2048) {
+						if (zero && iso_holes && !i->second.prewritten)
+							lseek64(iso_fd,2048,SEEK_CUR);
+						else if (!i->second.prewritten && write(iso_fd,sectorbuffer,2048) < 2048) {
 							fprintf(stderr,"write error: cannot write iso image. %s\n",strerror(errno));
 							exit(1);
 						}
@@ -1676,8 +5963,15 @@ int main(int argc,char **argv) {
 							md5_update(&f->md5_ctx,sectorbuffer,rd);
 							hash_len += rd;
 						}
+
+						/* (at the end of the file, the checkpoint waits until its digests are in the journal) */
+						if (journal_fp && n >= journal_next && n < i->second.end)
+							journal_checkpoint(n,iso_sectors,&sha256_ctx,&sha1_ctx,&md5_ctx,f,cp,hash_len);
 					}
-					close(in_fd);
+					if (!in_pread)
+						close(in_fd);
+					if (i->second.prewritten)
+						lseek64(iso_fd,n << 11ULL,SEEK_SET);
 
 					if (cp != f->file_size) {
 						cerr << "error: i read in " << cp <<
@@ -1696,6 +5990,7 @@ int main(int argc,char **argv) {
 					sha256_finish(&f->sha256_ctx,f->sha256);
 					sha1_finish(&f->sha1_ctx,f->sha1);
 					md5_finish(&f->md5_ctx,f->md5);
+					if (journal_fp) journal_file_done(f);
 				}
 			}
 			else if (i->second.content) {
@@ -1728,11 +6023,69 @@ int main(int argc,char **argv) {
 					}
 				}
 			}
+			else if (i->second.mirror_of) {
+				/* the metadata mirror, sector by sector from the metadata partition */
+				while (n < i->second.end) {
+					metadata_mirror_sector(i->second.mirror_of + (n - i->second.start),sectorbuffer);
+					n++;
+
+					if (write(iso_fd,sectorbuffer,2048) < 2048) {
+						fprintf(stderr,"write error: cannot write iso image. %s\n",strerror(errno));
+						exit(1);
+					}
+
+					if (do_hash) {
+						sha256_update(&sha256_ctx,sectorbuffer,2048);
+						sha1_update(&sha1_ctx,sectorbuffer,2048);
+						md5_update(&md5_ctx,sectorbuffer,2048);
+						iso_sectors++;
+					}
+				}
+			}
+			else if (i->second.prewritten) {
+				/* reserved sectors that are already in the ISO. they only need reading for the hashes */
+				while (do_hash && n < i->second.end) {
+					if (pread64(iso_fd,sectorbuffer,2048,n << 11ULL) < 2048)
+						memset(sectorbuffer,0,2048);
+					if (append_session && n == 256) {
+						memset(sectorbuffer,0,2048);
+						memcpy(sectorbuffer,UDFAnchor1->content,UDFAnchor1->content_length);
+					}
+					sha256_update(&sha256_ctx,sectorbuffer,2048);
+					sha1_update(&sha1_ctx,sectorbuffer,2048);
+					md5_update(&md5_ctx,sectorbuffer,2048);
+					iso_sectors++;
+					n++;
+				}
+				n = i->second.end;
+				lseek64(iso_fd,n << 11ULL,SEEK_SET);
+			}
+
+			if (journal_fp && n >= journal_next)
+				journal_checkpoint(n,iso_sectors,&sha256_ctx,&sha1_ctx,&md5_ctx,NULL,0,0);
 
 			/* next item */
 			i++;
 		}
 
+		/* the new session is complete: point the anchor at it */
+		if (append_session) {
+			memset(sectorbuffer,0,2048);
+			memcpy(sectorbuffer,UDFAnchor1->content,UDFAnchor1->content_length);
+			if (fdatasync(iso_fd) < 0 || pwrite64(iso_fd,sectorbuffer,2048,256ULL << 11ULL) < 2048 ||
+				fdatasync(iso_fd) < 0) {
+				fprintf(stderr,"write error: cannot write the anchor. %s\n",strerror(errno));
+				return 1;
+			}
+		}
+
+		/* a clone of a larger previous build, or an interrupted one, still has its tail. and
+		 * an ISO that ends in a hole has to be made that long */
+		if ((previous_image != "" || resume_build || iso_holes) && ftruncate64(iso_fd,n << 11ULL) < 0) {
+			fprintf(stderr,"Cannot truncate ISO: %s\n",strerror(errno));
+			return 1;
+		}
+
 		if (do_hash) {
 			sha256_finish(&sha256_ctx,iso_sha256);
 			sha1_finish(&sha1_ctx,iso_sha1);
@@ -1751,7 +6104,7 @@ int main(int argc,char **argv) {
 			return 1;
 		}
 
-		time_t t = time(NULL);
+		time_t t = build_time;
 		fprintf(rfp,"mkudfiso hash table for volume \"%s\" volumeset \"%s\"\n",
 			volume_label.c_str(),
 			volume_set_identifier.c_str());
@@ -1760,9 +6113,12 @@ int main(int argc,char **argv) {
 		{
 			map<UDF_Uint64,OutputExtent>::iterator i = output_extents.begin();
 			while (i != output_extents.end()) {
-				if (i->second.file) {
-					fprintf(rfp,"Entry %s\n",i->second.file->name.c_str());
-					fprintf(rfp,"\t" "Absolute path: %s\n",i->second.file->abspath.c_str());
+				/* the file the extent belongs to, then any others sharing it (same data, same hashes) */
+				FileEntry *f = i->second.file;
+				multimap<UDF_Uint64,FileEntry*>::iterator si = shared_extents.lower_bound(i->first);
+				while (f) {
+					fprintf(rfp,"Entry %s\n",f->name.c_str());
+					fprintf(rfp,"\t" "Absolute path: %s\n",f->abspath.c_str());
 					fprintf(rfp,"\t" "Hash length: %Lu\n",i->second.file->hash_length);
 					fprintf(rfp,"\t" "Sectors: %Lu-%Lu\n",i->second.start,i->second.end-1LL);
 
@@ -1785,6 +6141,8 @@ int main(int argc,char **argv) {
 #undef C4
 #undef C
 					fprintf(rfp,"\n");
+
+					f = (si != shared_extents.end() && si->first == i->first) ? (si++)->second : NULL;
 				}
 
 				i++;
@@ -1821,8 +6179,9 @@ int main(int argc,char **argv) {
 			close(fd);
 		}
 
-		/* if space allows, append the report as an Implementation Specific UDF tag */
-		if (iso_size_limit > 0 && (highest_sector << 11LL) + report_sz + 4096 > iso_size_limit) {
+		/* if space allows, append the report as an Implementation Specific UDF tag. it goes after
+		 * everything else, the report included */
+		if (iso_size_limit > 0 && (output_extents.rbegin()->second.end << 11LL) + report_sz + 4096 > iso_size_limit) {
 			cerr << "Not inserting report into ISO, not enough space" << endl;
 		}
 		else {
@@ -1843,7 +6202,7 @@ int main(int argc,char **argv) {
 			{
 				UDF_tag_implementation_use_volume_descriptor ftag;
 				memset(&ftag,0,sizeof(ftag));
-				SET_UDF_tag(ftag.DescriptorTag,UDFtag_ImplementationUseVolumeDescriptor,descriptor_sector);
+				SET_UDF_tag(ftag.DescriptorTag,UDFtag_ImplementationUseVolumeDescriptor,descriptor_sector,DESCRIPTOR_VERSION);
 				UPDATE_UDF_tag(ftag.DescriptorTag);
 				LSETDWORD(&ftag.VolumeDescriptorSequenceNumber,1);
 				SET_UDF_regid(ftag.ImplementationIdentifier,1,"*mkudfiso","Hashtbl");
@@ -1908,8 +6267,9 @@ int main(int argc,char **argv) {
 
 			if (i->second.file) {
 				FileEntry *f = i->second.file;
-				UDF_Uint64 end = i->second.start + (f->file_size >> 11LL);
-				unsigned int esb = ((unsigned int)f->file_size)&0x7FF;
+				UDF_Uint64 stored = f->file_size - (f->hole_sectors << 11ULL);	/* -sparse: less the zeros */
+				UDF_Uint64 end = i->second.start + (stored >> 11LL);
+				unsigned int esb = ((unsigned int)stored)&0x7FF;
 
 				if (esb != 0) {
 					fprintf(gapfp,"(%Lu,%u-2047)\n",end,esb);
@@ -1929,6 +6289,10 @@ int main(int argc,char **argv) {
 
 				n = end;
 			}
+			else if (i->second.mirror_of || (i->first >= metadata_start && i->first < metadata_end)) {
+				/* the unused end of the metadata partition isn't a gap: the mirror has to stay a copy */
+				n = i->second.end;
+			}
 
 			/* next item */
 			i++;
@@ -1950,6 +6314,12 @@ int main(int argc,char **argv) {
 		fclose(gapfp);
 	}
 
+	/* the ISO is complete, nothing left to resume */
+	if (journal_fp) {
+		fclose(journal_fp);
+		unlink(journal_path.c_str());
+	}
+
 	if (iso_fd != 1)
 		close(iso_fd);
 
@@ -51,7 +51,7 @@ typedef UDF_Uint8 UDF_dstring;
 
 #define UDF_dstring_strncpyne(d,sz,str) { \
 	int l = strlen(str); \
-	if (l > ((sz)-1)) l = (sz)-1; \
+	if (l > (int)((sz)-1)) l = (sz)-1; \
 	if (l == 0) { \
 		d[0] = 0; \
 	} \
@@ -64,7 +64,7 @@ typedef UDF_Uint8 UDF_dstring;
 
 #define UDF_dstring_strncpy(d,sz,str) { \
 	int l = strlen(str); \
-	if (l > ((sz)-2)) l = (sz)-2; \
+	if (l > (int)((sz)-2)) l = (sz)-2; \
 	if (l == 0) { \
 		d[0] = 0; \
 	} \
@@ -109,7 +109,8 @@ typedef struct {
 #define SET_UDF_regid(tag,flag,id,idsuf) { \
 	memset(&(tag),0,sizeof(UDF_regid)); \
 	(tag).Flags = flag; \
-	strncpy((char*)((tag).Identifier),(const char*)(id),23); \
+	size_t idl = strlen((const char*)(id)); \
+	memcpy((tag).Identifier,(id),idl < 23 ? idl : 23);	/* no terminating NUL if it's all 23 */ \
 	strncpy((char*)((tag).IdentifierSuffix),(const char*)(idsuf),8); \
 }
 
@@ -145,8 +146,9 @@ typedef struct {
 	UDF_Uint32	TagLocation;			// +12	(the number of the sector holding this tag)
 } UDF_tag  PACKED;					// +16
 
-#define SET_UDF_tag(tag,id,location) { \
-	LSETWORD(&((tag).DescriptorVersion),2); \
+/* NSR02 volumes record version 2 descriptors, NSR03 (ECMA-167 3rd edition) ones version 3 */
+#define SET_UDF_tag(tag,id,location,version) { \
+	LSETWORD(&((tag).DescriptorVersion),version); \
 	LSETWORD(&((tag).TagIdentifier),id); \
 	UDF_Uint32 v = location; \
 	LSETDWORD(&((tag).TagLocation),v); \
@@ -316,6 +318,24 @@ typedef struct {
 		// in other words, how this works is up to the recipient and sender. goodie...
 } UDF_partition_map_type2  PACKED;				// +64
 
+/* Metadata Partition Map (UDF 2.50 2.2.10), a type 2 partition map */
+typedef struct {
+	UDF_Uint8	PartitionMapType;			// +0 = 2
+	UDF_Uint8	PartitionMapLength;			// +1 = 64
+	UDF_Uint8	reserved1[2];				// +2
+	UDF_regid	PartitionTypeIdentifier;		// +4   "*UDF Metadata Partition"
+	UDF_Uint16	VolumeSequenceNumber;			// +36
+	UDF_Uint16	PartitionNumber;			// +38  the physical partition the metadata file is in
+	UDF_Uint32	MetadataFileLocation;			// +40  File Entries (ICB file type 250, 251, 252) in that partition
+	UDF_Uint32	MetadataMirrorFileLocation;		// +44
+	UDF_Uint32	MetadataBitmapFileLocation;		// +48  0xFFFFFFFF = none (read only media)
+	UDF_Uint32	AllocationUnitSize;			// +52  in blocks
+	UDF_Uint16	AlignmentUnitSize;			// +56  in blocks
+	UDF_Uint8	Flags;					// +58
+		// bit 0: duplicate metadata (the mirror file has its own copy of the metadata)
+	UDF_Uint8	reserved2[5];				// +59
+} UDF_partition_map_metadata  PACKED;				// +64
+
 /* Unallocated Space Descriptor (ECMA-167 3/10.8) */
 typedef struct {
 	UDF_tag		DescriptorTag;				// +0